@@ -1,57 +1,178 @@
 #include "huffman_tree.h"
+#if defined(__unix__) || defined(__APPLE__)
+#define HUFFMAN_TREE_USE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
 
 /*
 Preconditions: file_name is the name of (and possibly path to) a text file
 Postconditions: Reads the contents of file_name and constructs a
-				huffman tree based on the character frequencies of the file contents
+				huffman tree based on the character frequencies of the file contents.
+				With code_mode::canonical the codes are rebuilt from the tree's code
+				lengths, so they only depend on code_lengths().
+				If max_code_length is not zero and the tree has longer codes, the code
+				lengths are replaced by the best lengths within max_code_length and the
+				codes are canonical in either mode. max_code_length is raised if needed
+				so that every character can get a code
 */
-huffman_tree::huffman_tree(const std::string &file_name) {
+huffman_tree::huffman_tree(const std::string &file_name, code_mode mode, unsigned int max_code_length) {
 	read_file(file_name);
-	for (auto it = frequencies.begin(); it != frequencies.end(); it++) {
-		if (it->second > 0) {
-			Node* node = new Node(it->first, it->second); //Each node created here is a leaf node, it has a valid character
-			node_queue.push(node);
-		}
-	}
-	while (node_queue.size() > 1) {
-		Node* node = new Node(); //Each node created here is not a leaf node, it doesn't have a valid ascii value and thus won't be read
-		Node* left = node_queue.top();
-		node_queue.pop();
-		Node* right = node_queue.top();
-		node_queue.pop();
-		node->frequency = left->frequency + right->frequency;
-		node->left = left;
-		node->right = right;
-		node_queue.push(node);
-	}
-	if (!node_queue.empty() && frequencies.size() != 1)
-		encode_characters("", node_queue.top());
-	if (frequencies.size() == 1) { //If there is only one character, than there is only one encoding, "0"
-		auto it = frequencies.begin();
-		encoded_chars.emplace(it->first, "0");
+	build_tree(mode, max_code_length);
+}
+
+/*
+Preconditions: code_lengths holds the code length of each character indexed by its
+				unsigned value, such as the result of code_lengths(), zero for characters
+				not in the tree
+Postconditions: Constructs a huffman_tree with the canonical codes for those lengths.
+				If the lengths can't form a prefix code, the tree has no characters
+*/
+huffman_tree::huffman_tree(const std::vector<uint8_t> &code_lengths) {
+	assign_canonical_codes(code_lengths.data(), code_lengths.size());
+	build_decode_table();
+}
+
+/*
+Preconditions: data points to size bytes of contents already in memory
+Postconditions: Same as the file constructor, but for the characters of data, so no file is read
+*/
+huffman_tree::huffman_tree(const char *data, std::size_t size, code_mode mode, unsigned int max_code_length) {
+	count_bytes(data, size, frequencies);
+	build_tree(mode, max_code_length);
+}
+
+/*
+Preconditions: counts holds the number of times each character appears, indexed by its unsigned value
+Postconditions: Same as the file constructor, but for frequencies that were already counted
+*/
+huffman_tree::huffman_tree(const byte_histogram &counts, code_mode mode, unsigned int max_code_length) {
+	rebuild(counts, mode, max_code_length);
+}
+
+/*
+Postconditions: Constructs a huffman_tree with no characters, ready for rebuild
+*/
+huffman_tree::huffman_tree() {
+}
+
+/*
+Preconditions: counts holds the number of times each character appears, indexed by its unsigned value
+Postconditions: Replaces the tree with the one the histogram constructor would build. The node array,
+				code table and decode tables are reused, so once the decode tables have grown to the
+				largest size needed, rebuilding doesn't allocate them again
+*/
+void huffman_tree::rebuild(const byte_histogram &counts, code_mode mode, unsigned int max_code_length) {
+	for (unsigned int i = 0; i < 256; i++)
+		frequencies[i] = counts[i];
+	build_tree(mode, max_code_length);
+}
+
+/*
+Postconditions: Empties the tree so it has no characters, keeping its storage for the next rebuild
+*/
+void huffman_tree::reset() {
+	for (unsigned int i = 0; i < 256; i++) {
+		frequencies[i] = 0;
+		code_table[i].bits = 0;
+		code_table[i].length = 0;
 	}
+	node_count = 0;
+	root = Node::no_child;
+	decode_table.clear();
+	decode_root_bits = 0;
+	multi_decode_table.clear();
 }
 
-huffman_tree::~huffman_tree() {
-    if (!node_queue.empty()) { //Don't attempt to access empty queue
-        Node* node = node_queue.top();
-        node_queue.pop();
-        delete_tree(node);
-    }
+/*
+Postconditions: Chooses how decode finds characters. decode_mode::multi_symbol builds a second table,
+				indexed by the next 11 bits, that holds every code ending within those bits, so runs
+				of short codes are decoded several characters per lookup. The codes and the decoded
+				results are the same in both modes. The mode is kept when the tree is rebuilt
+*/
+void huffman_tree::set_decode_mode(decode_mode mode) {
+	decoding = mode;
+	build_multi_decode_table();
 }
 
 /*
-Preconditions: Character is a character with an ASCII value
-				between 0 and 127 (inclusive).
+Preconditions: Character is any character, including byte values 128 to 255
 Postconditions: Returns the Huffman code for character if character is in the tree
 				and an empty string otherwise.
 */
 std::string huffman_tree::get_character_code(char character) const {
-	auto it = encoded_chars.find(character);
-	if (it == encoded_chars.end())
-		return "";
-	else
-		return it->second;
+	const code_entry &code = code_table[static_cast<unsigned char>(character)];
+	std::string code_string(code.length, '0');
+	for (unsigned int bit = 0; bit < code.length; bit++) {
+		if ((code.bits >> (code.length - 1 - bit)) & 1)
+			code_string[bit] = '1';
+	}
+	return code_string;
+}
+
+/*
+Postconditions: Returns 256 bytes holding the code length of each character indexed by
+				its unsigned value, zero for characters not in the tree. This is all
+				that is needed to rebuild canonical codes
+*/
+std::vector<uint8_t> huffman_tree::code_lengths() const {
+	std::vector<uint8_t> lengths(256, 0);
+	for (unsigned int i = 0; i < 256; i++)
+		lengths[i] = code_table[i].length;
+	return lengths;
+}
+
+/*
+Postconditions: Returns the exact number of code bits the characters counted when the tree was
+				built take with its codes, and the Shannon bound for the same counts, in one pass
+				over the 256 characters. Both are zero for a tree built from code lengths, which
+				has no counts
+*/
+size_estimate huffman_tree::encoded_size() const {
+	size_estimate estimate;
+	for (unsigned int i = 0; i < 256; i++)
+		estimate.huffman_bits += frequencies[i] * code_table[i].length;
+	estimate.entropy_bits = entropy_bits(frequencies);
+	return estimate;
+}
+
+/*
+Postconditions: Returns what encoded_size would return for a tree built from counts with no code
+				length limit, without building the tree. Only the counts are sorted, the code
+				lengths aren't needed since each merge of two subtrees adds their combined count
+				to the total once
+*/
+size_estimate huffman_tree::estimate_compressed_bits(const byte_histogram &counts) {
+	size_estimate estimate;
+	estimate.entropy_bits = entropy_bits(counts.data());
+	uint64_t leaves[256];
+	unsigned int leaf_count = 0;
+	for (unsigned int i = 0; i < 256; i++) {
+		if (counts[i] > 0)
+			leaves[leaf_count++] = counts[i];
+	}
+	if (leaf_count == 1) { //A lone character still takes a one bit code
+		estimate.huffman_bits = leaves[0];
+		return estimate;
+	}
+	std::sort(leaves, leaves + leaf_count);
+	uint64_t merged[256]; //Combined counts in the order they are made, which never decreases
+	unsigned int next_leaf = 0, next_merged = 0, merged_count = 0;
+	auto take_smallest = [&]() {
+		if (next_merged == merged_count || (next_leaf < leaf_count && leaves[next_leaf] <= merged[next_merged]))
+			return leaves[next_leaf++];
+		return merged[next_merged++];
+	};
+	for (unsigned int i = 1; i < leaf_count; i++) {
+		uint64_t combined = take_smallest();
+		combined += take_smallest();
+		merged[merged_count++] = combined;
+		estimate.huffman_bits += combined;
+	}
+	return estimate;
 }
 
 /*
@@ -62,148 +183,1704 @@ Postconditions: Returns the Huffman encoding for the contents of file_name
 				return an empty string
 */
 std::string huffman_tree::encode(const std::string &file_name) const {
-	std::string encoded;
-	std::ifstream file(file_name);
-	if (file.is_open()) {
-		std::string line;
-		char character;
-		while (std::getline(file, line)) {
-			for (unsigned int i = 0; i < line.size(); i++) {
-				character = line[i];
-				auto it = encoded_chars.find(character);
-				if (it == encoded_chars.end())
-					return "";
-				else
-					encoded += it->second;
-			}
-			if (file.good()) {
-				auto it = encoded_chars.find('\n');
-				if (it != encoded_chars.end())
-					encoded += it->second;
-				else
-					return "";
-			}
+	mapped_file file(file_name);
+	if (!file.is_open())
+		return "";
+	const unsigned char *data = reinterpret_cast<const unsigned char *>(file.data());
+	uint64_t bit_count = 0;
+	for (std::size_t i = 0; i < file.size(); i++) { //Sizing the result first means it is written in place
+		if (code_table[data[i]].length == 0)
+			return "";
+		bit_count += code_table[data[i]].length;
+	}
+	std::string encoded(bit_count, '0');
+	std::size_t position = 0;
+	for (std::size_t i = 0; i < file.size(); i++) {
+		const code_entry &code = code_table[data[i]];
+		for (unsigned int bit = code.length; bit > 0; bit--, position++) {
+			if ((code.bits >> (bit - 1)) & 1)
+				encoded[position] = '1';
 		}
-		file.close();
 	}
-	else
-		return "";
 	return encoded;
 }
 
+/*
+Preconditions: file_name is the name of (and possibly path to) a text file
+Postconditions: Returns the Huffman encoding for the contents of file_name packed
+				eight code bits per byte, along with the exact number of code bits.
+				If the file does not exist or contains letters not present in the
+				huffman_tree, the result has no bytes and a bit_count of zero
+*/
+packed_bits huffman_tree::encode_packed(const std::string &file_name) const {
+	packed_bits packed;
+	mapped_file file(file_name); //Encodes straight from the file's pages instead of copying them into a buffer
+	if (!file.is_open() || !encode_bytes(file.data(), file.size(), packed))
+		return packed_bits();
+	return packed;
+}
+
+/*
+Preconditions: data points to size bytes of contents already in memory
+Postconditions: Same as encode_packed for a file holding those bytes
+*/
+packed_bits huffman_tree::encode_packed(const char *data, std::size_t size) const {
+	packed_bits packed;
+	if (!encode_bytes(data, size, packed))
+		return packed_bits();
+	return packed;
+}
+
 /*
 Preconditions: string_to_decode is a string containing Huffman-encoded text
 Postconditions: Returns the plaintext represented by the string if the string
 				is a valid Huffman encoding and an empty string otherwise
 */
 std::string huffman_tree::decode(const std::string &string_to_decode) const {
+	packed_bits packed;
+	packed.bytes.assign((string_to_decode.size() + 7) / 8, 0);
+	packed.bit_count = string_to_decode.size();
+	for (unsigned int i = 0; i < string_to_decode.size(); i++) {
+		char bit = string_to_decode[i];
+		if (bit == '1')
+			packed.bytes[i / 8] |= static_cast<uint8_t>(0x80 >> (i % 8));
+		else if (bit != '0') //If something other than a 0 or 1 is read, return an empty string as that is not a valid encoding
+			return "";
+	}
+	return decode(packed);
+}
+
+/*
+Preconditions: packed holds Huffman-encoded text, such as the result of encode_packed
+Postconditions: Returns the plaintext represented by the first packed.bit_count bits
+				if they are a valid Huffman encoding and an empty string otherwise
+*/
+std::string huffman_tree::decode(const packed_bits &packed) const {
+	return decode(packed.bytes.data(), packed.bytes.size(), packed.bit_count);
+}
+
+/*
+Preconditions: bytes points to byte_count bytes holding bit_count code bits packed like encode_packed
+Postconditions: Same as decode for a packed_bits with those bytes, without copying them
+*/
+std::string huffman_tree::decode(const uint8_t *bytes, std::size_t byte_count, uint64_t bit_count) const {
 	std::string decoded;
-	if (frequencies.size() > 1) {
-		unsigned int i = 0;
-		while (i < string_to_decode.size()) {
-            //I need to start back at the top of the tree after finding each character
-			Node* node = node_queue.top();
-            //Traverse the tree according to the characters in the string
-			while (node != nullptr && node->character < 0 && i < string_to_decode.size()) {
-				char bit = string_to_decode[i];
-				if (bit == '0') {
-					node = node->left;
-					i++;
-				}
-				else if (bit == '1') {
-					node = node->right;
-					i++;
-				}
-				else //If something other than a 0 or 1 is read, return an empty string as that is not a valid encoding
-					return "";
+	if (!decode_into(bytes, byte_count, bit_count, decoded))
+		return "";
+	return decoded;
+}
+
+/*
+Preconditions: input_file_name is the name of (and possibly path to) a file
+Postconditions: Writes a compressed copy of input_file_name to output_file_name, which
+				decompress_file can restore without the original file. Returns true on
+				success and false if a file can't be opened or the contents can't be encoded.
+				The compressed file holds, with integers stored least significant byte first:
+					"HUFZ", version (1 byte), model, original size in bytes (8 bytes),
+					payload size in bits (8 bytes), payload packed like encode_packed,
+					CRC32 of the original contents (4 bytes)
+				where a model is the symbol count (2 bytes) followed by symbol count pairs
+				of (character, code length) (1 byte each)
+*/
+bool huffman_tree::compress_file(const std::string &input_file_name, const std::string &output_file_name) {
+	mapped_file data(input_file_name);
+	std::vector<uint8_t> container;
+	if (!data.is_open() || !compress(data.data(), data.size(), container))
+		return false;
+	return write_file(output_file_name, reinterpret_cast<const char*>(container.data()), container.size());
+}
+
+/*
+Preconditions: data points to size bytes of contents already in memory
+Postconditions: Replaces the contents of container with the same bytes compress_file would write
+				for a file holding data, and returns true, or returns false if the contents can't
+				be encoded. data is only read once, for both the frequencies and the encoding,
+				and container keeps its storage so it can be reused for the next call
+*/
+bool huffman_tree::compress(const char *data, std::size_t size, std::vector<uint8_t> &container) {
+	huffman_tree tree(data, size, code_mode::canonical, container_max_code_length); //Canonical codes so the code lengths are the whole model
+	packed_bits packed;
+	if (!tree.encode_bytes(data, size, packed))
+		return false;
+	container.assign({ 'H', 'U', 'F', 'Z', container_version });
+	tree.append_model(container);
+	append_uint(container, size, 8);
+	append_uint(container, packed.bit_count, 8);
+	container.insert(container.end(), packed.bytes.begin(), packed.bytes.end());
+	append_uint(container, crc32(data, size), 4);
+	return true;
+}
+
+/*
+Preconditions: input_file_name is the name of (and possibly path to) a file, block_size is
+				greater than zero and at most max_block_size
+Postconditions: Same as compress_file, but the contents are split into blocks of block_size
+				bytes that are each given their own model and encoded by thread_count threads,
+				or one thread per core if thread_count is zero. The output doesn't depend on
+				thread_count. The compressed file holds:
+					"HUFB", version 3 (1 byte), block size (4 bytes), original size (8 bytes),
+					the compressed size of each block (8 bytes each), the blocks,
+					CRC32 of the original contents (4 bytes)
+				where each block is a type byte followed by:
+					new model: a model, its payload size in bits (8 bytes) and its payload
+					reused model: the payload size and payload, encoded with the model of
+						the last block that had one
+					raw: the characters of the block unchanged
+					run: the one character the whole block repeats
+				Each block takes whichever type is smallest, counted exactly from its histogram,
+				so no block is more than one byte larger than its characters. Reused models are
+				only picked with block_model::switching. With stream_mode::interleaved the
+				version is 4 and each block is split into 4 parts of (block size + 3) / 4 bytes,
+				the last one shorter, encoded as separate payloads with the same model. The
+				payload size in bits of each part (8 bytes each) is then followed by the 4
+				payloads one after another. Versions 1 and 2, where each block is only a model
+				and its payloads, are still read
+*/
+bool huffman_tree::compress_file(const std::string &input_file_name, const std::string &output_file_name, std::size_t block_size, unsigned int thread_count, stream_mode streams, block_model models) {
+	mapped_file data(input_file_name);
+	std::vector<uint8_t> container;
+	if (!data.is_open() || !compress(data.data(), data.size(), container, block_size, thread_count, streams, models))
+		return false;
+	return write_file(output_file_name, reinterpret_cast<const char*>(container.data()), container.size());
+}
+
+/*
+Preconditions: data points to size bytes of contents already in memory, block_size is greater
+				than zero and at most max_block_size
+Postconditions: Same as the other compress, but writes the block format of the block compress_file.
+				With block_model::independent each block is counted and then encoded right away,
+				while it is still in the cache. With block_model::switching every block is counted
+				before the types can be picked in order and the blocks encoded
+*/
+bool huffman_tree::compress(const char *data, std::size_t size, std::vector<uint8_t> &container, std::size_t block_size, unsigned int thread_count, stream_mode streams, block_model models) {
+	if (block_size == 0 || block_size > max_block_size)
+		return false;
+	std::size_t block_count = (size + block_size - 1) / block_size;
+	std::vector<std::vector<uint8_t>> blocks(block_count);
+	if (!encode_typed_blocks(data, size, block_size, thread_count, streams, models, blocks))
+		return false;
+	container.assign({ 'H', 'U', 'F', 'B', streams == stream_mode::interleaved ? typed_interleaved_container_version : typed_container_version });
+	append_uint(container, block_size, 4);
+	append_uint(container, size, 8);
+	for (std::size_t i = 0; i < block_count; i++)
+		append_uint(container, blocks[i].size(), 8);
+	for (std::size_t i = 0; i < block_count; i++)
+		container.insert(container.end(), blocks[i].begin(), blocks[i].end());
+	append_uint(container, crc32(data, size), 4);
+	return true;
+}
+
+/*
+Preconditions: input_file_name is the name of (and possibly path to) a file written by either
+				compress_file
+Postconditions: Writes the original contents to output_file_name. Returns true on success and
+				false if a file can't be opened or the compressed file is damaged, in which case
+				output_file_name is not written. The blocks of a block compressed file are
+				decoded by thread_count threads, or one thread per core if thread_count is zero
+*/
+bool huffman_tree::decompress_file(const std::string &input_file_name, const std::string &output_file_name, unsigned int thread_count) {
+	mapped_file container(input_file_name);
+	std::string data;
+	if (!container.is_open() || !decompress(reinterpret_cast<const uint8_t*>(container.data()), container.size(), data, thread_count))
+		return false;
+	return write_file(output_file_name, data.data(), data.size());
+}
+
+/*
+Preconditions: container points to size bytes written by compress or compress_file
+Postconditions: Sets data to the original contents and returns true, or returns false if the
+				compressed bytes are damaged. Blocks are decoded by thread_count threads,
+				or one thread per core if thread_count is zero
+*/
+bool huffman_tree::decompress(const uint8_t *container, std::size_t size, std::string &data, unsigned int thread_count) {
+	data.clear();
+	if (size < 5)
+		return false;
+	if (container[0] == 'H' && container[1] == 'U' && container[2] == 'F' && container[3] == 'Z' && container[4] == container_version)
+		return decode_container(container, size, data);
+	stream_mode streams;
+	bool typed;
+	if (container[0] == 'H' && container[1] == 'U' && container[2] == 'F' && container[3] == 'B' && read_block_version(container[4], streams, typed))
+		return decode_block_container(container, size, data, thread_count);
+	return false;
+}
+
+/*
+Preconditions: input_file_name is the name of (and possibly path to) a file written by the
+				block compress_file
+Postconditions: Sets data to length bytes of the original contents starting at offset and
+				returns true. Only the index and the blocks holding those bytes are read, so
+				the CRC32 of the whole file is not checked. Returns false if the file can't be
+				opened, isn't block compressed, the range is past the end of the original
+				contents, or a block that was read is damaged
+*/
+bool huffman_tree::decompress_range(const std::string &input_file_name, uint64_t offset, uint64_t length, std::string &data) {
+	data.clear();
+	std::ifstream input(input_file_name, std::ios::binary);
+	if (!input.is_open())
+		return false;
+	input.seekg(0, std::ios::end);
+	uint64_t file_size = static_cast<uint64_t>(input.tellg());
+	input.seekg(0, std::ios::beg);
+	std::vector<uint8_t> header(block_header_size);
+	stream_mode streams;
+	bool typed;
+	if (file_size < block_header_size + 4 || !input.read(reinterpret_cast<char*>(header.data()), header.size())
+		|| header[0] != 'H' || header[1] != 'U' || header[2] != 'F' || header[3] != 'B' || !read_block_version(header[4], streams, typed))
+		return false;
+	uint64_t block_size = read_uint(&header[5], 4);
+	uint64_t original_size = read_uint(&header[9], 8);
+	if (block_size == 0 || block_size > max_block_size)
+		return false;
+	uint64_t block_count = original_size / block_size + (original_size % block_size != 0);
+	if (block_count > (file_size - block_header_size - 4) / 8)
+		return false;
+	header.resize(block_header_size + 8 * static_cast<std::size_t>(block_count)); //Add the index to the header
+	if (!input.read(reinterpret_cast<char*>(&header[block_header_size]), header.size() - block_header_size))
+		return false;
+	std::vector<uint64_t> offsets;
+	if (!read_block_index(header.data(), header.size(), file_size, block_size, original_size, typed, offsets))
+		return false;
+	if (offset > original_size || length > original_size - offset)
+		return false;
+	std::vector<uint8_t> block;
+	std::string block_data;
+	auto read_block = [&](uint64_t i, uint64_t size) { //Reads the first size bytes of block i into block
+		block.resize(static_cast<std::size_t>(size));
+		input.seekg(static_cast<std::streamoff>(offsets[i]));
+		return size == 0 || static_cast<bool>(input.read(reinterpret_cast<char*>(block.data()), block.size()));
+	};
+	huffman_tree tree; //The model of a typed file in use, read from block model_block
+	uint64_t model_block = block_count;
+	std::vector<uint8_t> lengths;
+	auto read_block_model = [&](uint64_t i, std::size_t &position) { //Reads the model of block i, already in block, into tree
+		if (!read_model(block.data(), block.size(), position, lengths))
+			return false;
+		tree = huffman_tree(lengths);
+		if (streams == stream_mode::single && block_size >= multi_decode_min_size)
+			tree.set_decode_mode(decode_mode::multi_symbol);
+		model_block = i;
+		return true;
+	};
+	std::vector<uint8_t> payloads;
+	for (uint64_t i = offset / block_size; i < block_count && i * block_size < offset + length; i++) {
+		uint64_t size = i + 1 < block_count ? block_size : original_size - i * block_size;
+		if (!read_block(i, offsets[i + 1] - offsets[i]))
+			return false;
+		std::size_t position = 1;
+		if (!typed) {
+			if (!decode_block(block.data(), block.size(), streams, size, block_data))
+				return false;
+		}
+		else if (block.empty())
+			return false;
+		else if (block[0] == raw_block) {
+			if (block.size() - 1 != size)
+				return false;
+			block_data.assign(reinterpret_cast<const char*>(&block[1]), static_cast<std::size_t>(size));
+		}
+		else if (block[0] == run_block) {
+			if (block.size() != 2)
+				return false;
+			block_data.assign(static_cast<std::size_t>(size), static_cast<char>(block[1]));
+		}
+		else if (block[0] == new_model_block) {
+			if (!read_block_model(i, position) || !decode_payloads(tree, &block[position], block.size() - position, streams, size, block_data))
+				return false;
+		}
+		else if (block[0] == reused_model_block) {
+			payloads.assign(block.begin() + 1, block.end());
+			for (uint64_t j = i; model_block == block_count && j-- > 0; ) { //Only the first block read can need the model of a block before the range
+				if (offsets[j + 1] == offsets[j] || !read_block(j, 1))
+					return false;
+				if (block[0] == new_model_block && (!read_block(j, offsets[j + 1] - offsets[j]) || !read_block_model(j, position)))
+					return false;
 			}
-			if (node != nullptr)
-				decoded += node->character;
-			else //If the node is a nullptr, then an invalid code was passed in
-				return "";
-		}
-	}
-	else if (frequencies.size() == 1) {
-		auto it = frequencies.begin();
-		char only_char = it->first;
-		for (unsigned int i = 0; i < string_to_decode.size(); i++) {
-			char decode = string_to_decode[i];
-			if (decode == '0')
-				decoded += only_char;
-			else
-				return "";
+			if (model_block == block_count || !decode_payloads(tree, payloads.data(), payloads.size(), streams, size, block_data))
+				return false;
 		}
+		else
+			return false;
+		uint64_t start = offset > i * block_size ? offset - i * block_size : 0; //Only the first block can start partway through
+		uint64_t end = offset + length < (i + 1) * block_size ? offset + length - i * block_size : size;
+		data.append(block_data, static_cast<std::size_t>(start), static_cast<std::size_t>(end - start));
 	}
-    else {
-        return "";
-    }
-	return decoded;
+	return true;
 }
 
 //Helper structs and functions
 
-Node::Node(char character_, int frequency_) {
+Node::Node(unsigned char character_, uint64_t frequency_, bool leaf_) {
 	character = character_;
 	frequency = frequency_;
-	right = nullptr;
-	left = nullptr;
+	leaf = leaf_;
+	right = no_child;
+	left = no_child;
 }
 
 bool Compare::operator()(const Node* left, const Node* right) const {
-	return (left->frequency > right->frequency); //Use > so that the priority queue has the smallest frequencies at the top
+	return (left->frequency > right->frequency); //Use > so that the heap has the smallest frequencies at the top
 }
 
-void huffman_tree::read_file(const std::string &file_name) {
-	std::ifstream file(file_name);
-	if (file.is_open()) 
-	{
-		std::string line;
-		char character;
-		int numLines = 0; //Stores the number of newline characters in the file, as getline uses newline as its default delimiter, so it won't read newlines
-		while(std::getline(file, line)) {
-			for (unsigned int i = 0; i < line.size(); i++) {
-				character = line[i];
-				auto it = frequencies.find(character);
-				if (it == frequencies.end()) //Find returns an iterator pointing to the character, int pair if the character has already been put into the map, otherwise it points to end(), so a new character has been reached
-					frequencies.emplace(character, 1);
-				else
-					it->second += 1;
+void huffman_tree::build_tree(code_mode mode, unsigned int max_code_length) {
+    //Builds the tree, the codes and the decode tables from frequencies, reusing the storage of any earlier tree
+	unsigned int symbol_count = 0;
+	node_count = 0;
+	for (unsigned int i = 0; i < 256; i++) {
+		code_table[i].bits = 0;
+		code_table[i].length = 0;
+		if (frequencies[i] > 0) {
+			nodes[node_count++] = Node(static_cast<unsigned char>(i), frequencies[i], true); //Each node created here is a leaf node, it has a valid character
+			symbol_count++;
+		}
+	}
+	if (mode == code_mode::canonical) //Only the code lengths matter, so the faster merge can break ties its own way
+		root = merge_sorted_leaves();
+	else
+		root = merge_with_heap();
+	if (root != Node::no_child && symbol_count != 1)
+		encode_characters(root, 0, 0);
+	if (symbol_count == 1) //If there is only one character, than there is only one encoding, "0"
+		code_table[nodes[root].character].length = 1;
+	if (max_code_length == 0 || max_code_length > 64) //Codes are stored in 64 bits
+		max_code_length = 64;
+	bool too_long = false;
+	uint8_t lengths[256];
+	for (unsigned int i = 0; i < 256; i++) {
+		lengths[i] = code_table[i].length;
+		if (lengths[i] > max_code_length)
+			too_long = true;
+	}
+	if (too_long) {
+		limited_code_lengths(max_code_length, lengths);
+		assign_canonical_codes(lengths, 256);
+	}
+	else if (mode == code_mode::canonical)
+		assign_canonical_codes(lengths, 256);
+	build_decode_table();
+}
+
+bool huffman_tree::encode_bytes(const char *data, std::size_t size, packed_bits &packed) const {
+    //Same as encode_packed, but for contents already in memory
+	packed.bytes.clear();
+	packed.bit_count = 0;
+	unsigned int longest = 0;
+	for (unsigned int i = 0; i < 256; i++) {
+		if (code_table[i].length > longest)
+			longest = code_table[i].length;
+	}
+	const unsigned char *characters = reinterpret_cast<const unsigned char *>(data);
+	bit_writer writer(packed.bytes);
+	static const std::size_t chunk_size = 1 << 16; //Space is reserved for a chunk at a time, so the writer never checks it per code
+	for (std::size_t chunk = 0; chunk < size; chunk += chunk_size) {
+		std::size_t chunk_end = size - chunk < chunk_size ? size : chunk + chunk_size;
+		writer.reserve(static_cast<uint64_t>(chunk_end - chunk) * longest);
+		for (std::size_t i = chunk; i < chunk_end; i++) {
+			const code_entry &code = code_table[characters[i]];
+			if (code.length == 0) {
+				packed.bytes.clear();
+				return false;
 			}
-			if (file.good()) //If the end of the file hasn't been reached, then getline ran into a newline
-				numLines++;
+			writer.write(code.bits, code.length);
 		}
-		if (numLines > 0)
-			frequencies.emplace('\n', numLines); //Emplace the positive number of newline characters that were found
-		file.close();
 	}
+	packed.bit_count = writer.bit_count();
+	writer.finish();
+	return true;
 }
 
-void huffman_tree::encode_characters(std::string code, Node* node) {
-    //This function finds the encoding of each character and places it into a map, so files can be more quickly encoded
-	if (node->character >= 0) //If the node has a character greater than zero, than it is a leaf node storing an ascii character, so store that character along with the current string
-		encoded_chars.emplace(node->character, code);
-	else { //Else, continue traversing down the tree, adding a zero if going to the left child and a 1 if going to the right child
-		if (node->left != nullptr) {
-			std::string temp = code;
-			temp += "0";
-			encode_characters(temp, node->left);
+bool huffman_tree::decode_into(const uint8_t *bytes, std::size_t byte_count, uint64_t bit_count, std::string &decoded) const {
+    //Replaces the contents of decoded, so callers can reuse its storage
+	decoded.clear();
+	if (bit_count == 0) //Nothing to decode, even if the tree is empty
+		return true;
+	if (decode_table.empty() || byte_count < (bit_count + 7) / 8)
+		return false;
+	if (bit_count % 8 != 0 && (bytes[bit_count / 8] & (0xFF >> (bit_count % 8))) != 0) //The bits after the last code must be zero, as encode_packed leaves them
+		return false;
+	bit_reader reader(bytes, byte_count);
+	const decode_entry *table = decode_table.data(); //Local copies, since writing to decoded could otherwise change them as far as the compiler knows
+	unsigned int root_bits = decode_root_bits;
+	if (!multi_decode_table.empty()) {
+		//Whole windows are only looked up while they are inside the code bits, so padding is never decoded
+		const multi_decode_entry *multi_table = multi_decode_table.data();
+		std::size_t written = 0;
+		while (reader.position() + multi_decode_bits <= bit_count) {
+			if (decoded.size() < written + multi_decode_characters) //Every entry is copied whole, so keep room for all of it
+				decoded.resize(decoded.size() * 2 + 64);
+			if (reader.available() < multi_decode_bits)
+				reader.refill();
+			const multi_decode_entry &entry = multi_table[reader.peek(multi_decode_bits)];
+			if (entry.count > 0) {
+				std::memcpy(&decoded[written], entry.characters, multi_decode_characters);
+				written += entry.count;
+				reader.skip(entry.length);
+			}
+			else { //The first code is too long for the window, or not a code at all
+				int character = decode_symbol(reader, table, root_bits);
+				if (character < 0 || reader.position() > bit_count) //A damaged long code can run past the end of the bits
+					return false;
+				decoded[written++] = static_cast<char>(character);
+			}
 		}
-		if (node->right != nullptr) {
-			std::string temp = code;
-			temp += "1";
-			encode_characters(temp, node->right);
+		decoded.resize(written);
+	}
+	while (reader.position() < bit_count) {
+		int character = decode_symbol(reader, table, root_bits);
+		if (character < 0)
+			return false;
+		decoded += static_cast<char>(character);
+	}
+	return reader.position() == bit_count; //Otherwise the last code ran past the end of the bits
+}
+
+bool huffman_tree::decode_interleaved(const uint8_t *const bytes[], const std::size_t byte_counts[], const uint64_t bit_counts[], char *output, std::size_t size) const {
+    //Decodes interleaved_stream_count streams, each holding the next (size + 3) / 4 characters of output, one character
+    //from each stream per step. The streams don't depend on each other, so their lookups can overlap in the processor
+	static const unsigned int streams = interleaved_stream_count;
+	if (size > 0 && decode_table.empty())
+		return false;
+	for (unsigned int i = 0; i < streams; i++) {
+		if (byte_counts[i] < (bit_counts[i] + 7) / 8)
+			return false;
+		if (bit_counts[i] % 8 != 0 && (bytes[i][bit_counts[i] / 8] & (0xFF >> (bit_counts[i] % 8))) != 0) //Padding must be zero
+			return false;
+	}
+	bit_reader readers[streams] = { bit_reader(bytes[0], byte_counts[0]), bit_reader(bytes[1], byte_counts[1]),
+		bit_reader(bytes[2], byte_counts[2]), bit_reader(bytes[3], byte_counts[3]) };
+	std::size_t part_size = (size + streams - 1) / streams;
+	std::size_t starts[streams + 1];
+	for (unsigned int i = 0; i <= streams; i++)
+		starts[i] = i * part_size < size ? i * part_size : size;
+	const decode_entry *table = decode_table.data();
+	unsigned int root_bits = decode_root_bits;
+	std::size_t shortest = starts[streams] - starts[streams - 1]; //The last part is never longer than the others
+	unsigned int longest_code = 0;
+	for (unsigned int i = 0; i < 256; i++) {
+		if (code_table[i].length > longest_code)
+			longest_code = code_table[i].length;
+	}
+	//A refill leaves at least 57 bits, enough for this many codes without checking again
+	std::size_t per_refill = longest_code > 0 && longest_code <= 57 ? 57 / longest_code : 0;
+	bool valid = true;
+	std::size_t done = 0;
+	if (per_refill > 0) {
+		for (; done + per_refill <= shortest; done += per_refill) {
+			for (unsigned int stream = 0; stream < streams; stream++)
+				readers[stream].refill();
+			for (std::size_t i = done; i < done + per_refill; i++) {
+				//Invalid codes only clear valid here, so the four lookups of a step have no branch between them
+				int first = decode_refilled_symbol(readers[0], table, root_bits);
+				int second = decode_refilled_symbol(readers[1], table, root_bits);
+				int third = decode_refilled_symbol(readers[2], table, root_bits);
+				int fourth = decode_refilled_symbol(readers[3], table, root_bits);
+				output[starts[0] + i] = static_cast<char>(first);
+				output[starts[1] + i] = static_cast<char>(second);
+				output[starts[2] + i] = static_cast<char>(third);
+				output[starts[3] + i] = static_cast<char>(fourth);
+				valid &= (first | second | third | fourth) >= 0;
+			}
 		}
 	}
-	return;
+	for (unsigned int stream = 0; stream < streams && valid; stream++) {
+		for (std::size_t i = starts[stream] + done; i < starts[stream + 1]; i++) {
+			int character = decode_symbol(readers[stream], table, root_bits);
+			if (character < 0)
+				return false;
+			output[i] = static_cast<char>(character);
+		}
+		if (readers[stream].position() != bit_counts[stream]) //Each stream must end exactly at its last code
+			return false;
+	}
+	return valid;
+}
+
+inline int huffman_tree::decode_refilled_symbol(bit_reader &reader, const decode_entry *table, unsigned int root_bits) {
+    //Same as decode_symbol when the reader is known to hold the whole code, so there is nothing to check
+	const decode_entry *entry = &table[reader.peek(root_bits)];
+	while (entry->sub_bits != 0) {
+		reader.skip(entry->length);
+		entry = &table[entry->value + reader.peek(entry->sub_bits)];
+	}
+	if (entry->length == 0)
+		return -1;
+	reader.skip(entry->length);
+	return static_cast<int>(entry->value);
+}
+
+inline int huffman_tree::decode_symbol(bit_reader &reader, const decode_entry *table, unsigned int root_bits) {
+    //Each lookup either finds a whole character or points to a table for the remaining bits of a longer code
+	if (reader.available() < root_bits)
+		reader.refill();
+	const decode_entry *entry = &table[reader.peek(root_bits)];
+	while (entry->sub_bits != 0) {
+		reader.skip(entry->length);
+		if (reader.available() < entry->sub_bits)
+			reader.refill();
+		entry = &table[entry->value + reader.peek(entry->sub_bits)];
+	}
+	if (entry->length == 0) //The bits don't start any code
+		return -1;
+	reader.skip(entry->length);
+	return static_cast<int>(entry->value);
+}
+
+bool huffman_tree::decode_container(const uint8_t *container, std::size_t size, std::string &data) {
+    //Decodes a "HUFZ" file, the magic number and version have already been checked
+	std::vector<uint8_t> lengths;
+	std::size_t position = 5;
+	if (!read_model(container, size, position, lengths) || size - position < 8 + 8 + 4)
+		return false;
+	uint64_t original_size = read_uint(&container[position], 8);
+	uint64_t bit_count = read_uint(&container[position + 8], 8);
+	position += 16;
+	if (bit_count / 8 + (bit_count % 8 != 0) != size - position - 4) //The payload must fill the space before the CRC exactly
+		return false;
+	huffman_tree tree(lengths);
+	if (original_size >= multi_decode_min_size)
+		tree.set_decode_mode(decode_mode::multi_symbol);
+	return tree.decode_into(&container[position], size - position - 4, bit_count, data) && data.size() == original_size
+		&& crc32(data.data(), data.size()) == read_uint(&container[size - 4], 4);
+}
+
+bool huffman_tree::decode_block_container(const uint8_t *container, std::size_t size, std::string &data, unsigned int thread_count) {
+    //Decodes a "HUFB" file, the magic number and version have already been checked
+	if (size < block_header_size + 4)
+		return false;
+	stream_mode streams;
+	bool typed;
+	read_block_version(container[4], streams, typed);
+	uint64_t block_size = read_uint(&container[5], 4);
+	uint64_t original_size = read_uint(&container[9], 8);
+	std::vector<uint64_t> offsets;
+	if (!read_block_index(container, size, size, block_size, original_size, typed, offsets) || offsets.back() != size - 4)
+		return false;
+	std::size_t block_count = offsets.size() - 1;
+	std::vector<uint8_t> model_lengths;
+	std::vector<std::size_t> block_models;
+	std::vector<std::size_t> payload_starts;
+	if (typed && !read_typed_blocks(container, offsets, block_size, original_size, model_lengths, block_models, payload_starts))
+		return false;
+	data.assign(static_cast<std::size_t>(original_size), '\0');
+	std::atomic<std::size_t> next_block(0);
+	std::atomic<bool> failed(false);
+	auto decode_blocks = [&]() { //With the models read the blocks are independent, so each thread decodes straight into its part of data
+		std::string block_data;
+		huffman_tree tree; //The model of a typed file last used by this thread
+		std::size_t tree_model = block_count;
+		for (std::size_t i = next_block++; i < block_count && !failed; i = next_block++) {
+			uint64_t expected_size = i + 1 < block_count ? block_size : original_size - i * block_size;
+			const uint8_t *block = &container[static_cast<std::size_t>(offsets[i])];
+			std::size_t block_bytes = static_cast<std::size_t>(offsets[i + 1] - offsets[i]);
+			if (typed && block[0] == raw_block) {
+				std::memcpy(&data[i * block_size], block + 1, static_cast<std::size_t>(expected_size));
+				continue;
+			}
+			if (typed && block[0] == run_block) {
+				std::memset(&data[i * block_size], block[1], static_cast<std::size_t>(expected_size));
+				continue;
+			}
+			if (typed && block_models[i] != tree_model) {
+				tree_model = block_models[i];
+				tree = huffman_tree(std::vector<uint8_t>(&model_lengths[tree_model * 256], &model_lengths[tree_model * 256] + 256));
+				if (streams == stream_mode::single && block_size >= multi_decode_min_size)
+					tree.set_decode_mode(decode_mode::multi_symbol);
+			}
+			if (typed
+				? !decode_payloads(tree, block + payload_starts[i], block_bytes - payload_starts[i], streams, expected_size, block_data)
+				: !decode_block(block, block_bytes, streams, expected_size, block_data))
+				failed = true;
+			else
+				block_data.copy(&data[i * block_size], block_data.size());
+		}
+	};
+	run_threads(decode_blocks, thread_count, block_count);
+	return !failed && crc32(data.data(), data.size()) == read_uint(&container[size - 4], 4);
+}
+
+bool huffman_tree::read_block_index(const uint8_t *header, std::size_t size, uint64_t file_size, uint64_t block_size, uint64_t original_size, bool typed, std::vector<uint64_t> &offsets) {
+    //Turns the compressed block sizes in the index into the offset of each block in the file, plus the offset where the blocks end
+	if (block_size == 0 || block_size > max_block_size || (!typed && original_size / 8 > file_size)) //Every character takes at least one bit, unless runs can be stored
+		return false;
+	uint64_t block_count = original_size / block_size + (original_size % block_size != 0);
+	if (size < block_header_size || block_count > (size - block_header_size) / 8)
+		return false;
+	offsets.resize(static_cast<std::size_t>(block_count) + 1);
+	offsets[0] = block_header_size + 8 * block_count;
+	for (std::size_t i = 0; i < block_count; i++) {
+		uint64_t compressed_size = read_uint(&header[block_header_size + 8 * i], 8);
+		if (compressed_size > file_size - 4 - offsets[i])
+			return false;
+		offsets[i + 1] = offsets[i] + compressed_size;
+	}
+	return offsets[block_count] <= file_size - 4;
+}
+
+bool huffman_tree::decode_block(const uint8_t *block, std::size_t size, stream_mode streams, uint64_t original_size, std::string &data) {
+    //Decodes a block of a version 1 or 2 file, which must hold original_size characters
+	std::vector<uint8_t> lengths;
+	std::size_t position = 0;
+	if (!read_model(block, size, position, lengths))
+		return false;
+	huffman_tree tree(lengths);
+	if (streams == stream_mode::single && original_size >= multi_decode_min_size)
+		tree.set_decode_mode(decode_mode::multi_symbol);
+	return decode_payloads(tree, block + position, size - position, streams, original_size, data);
+}
+
+bool huffman_tree::encode_payloads(const huffman_tree &tree, const char *data, std::size_t size, stream_mode streams, std::vector<uint8_t> &block) {
+    //Appends the payload sizes in bits and the payloads, everything in a block after its model
+	unsigned int stream_count = streams == stream_mode::interleaved ? interleaved_stream_count : 1;
+	std::size_t part_size = (size + stream_count - 1) / stream_count;
+	packed_bits packed[interleaved_stream_count];
+	for (unsigned int i = 0; i < stream_count; i++) {
+		std::size_t start = i * part_size < size ? i * part_size : size;
+		std::size_t end = start + part_size < size ? start + part_size : size;
+		if (!tree.encode_bytes(data + start, end - start, packed[i]))
+			return false;
+	}
+	for (unsigned int i = 0; i < stream_count; i++)
+		append_uint(block, packed[i].bit_count, 8);
+	for (unsigned int i = 0; i < stream_count; i++)
+		block.insert(block.end(), packed[i].bytes.begin(), packed[i].bytes.end());
+	return true;
+}
+
+bool huffman_tree::decode_payloads(const huffman_tree &tree, const uint8_t *block, std::size_t size, stream_mode streams, uint64_t original_size, std::string &data) {
+    //Decodes what encode_payloads wrote with the same tree, which must be original_size characters
+	unsigned int stream_count = streams == stream_mode::interleaved ? interleaved_stream_count : 1;
+	if (size < 8 * stream_count)
+		return false;
+	uint64_t bit_counts[interleaved_stream_count];
+	const uint8_t *payloads[interleaved_stream_count];
+	std::size_t byte_counts[interleaved_stream_count];
+	std::size_t payload_start = 8 * stream_count;
+	for (unsigned int i = 0; i < stream_count; i++) {
+		bit_counts[i] = read_uint(block + 8 * i, 8);
+		uint64_t byte_count = bit_counts[i] / 8 + (bit_counts[i] % 8 != 0);
+		if (byte_count > size - payload_start) //The payloads must fill the rest of the block exactly
+			return false;
+		payloads[i] = block + payload_start;
+		byte_counts[i] = static_cast<std::size_t>(byte_count);
+		payload_start += byte_counts[i];
+	}
+	if (payload_start != size)
+		return false;
+	if (streams == stream_mode::single)
+		return tree.decode_into(payloads[0], byte_counts[0], bit_counts[0], data) && data.size() == original_size;
+	data.resize(static_cast<std::size_t>(original_size));
+	return tree.decode_interleaved(payloads, byte_counts, bit_counts, &data[0], data.size());
+}
+
+bool huffman_tree::read_block_version(uint8_t version, stream_mode &streams, bool &typed) {
+    //Finds the layout of a "HUFB" file from its version, false for versions this code doesn't know
+	streams = version == interleaved_container_version || version == typed_interleaved_container_version ? stream_mode::interleaved : stream_mode::single;
+	typed = version == typed_container_version || version == typed_interleaved_container_version;
+	return version >= container_version && version <= typed_interleaved_container_version;
 }
 
-void huffman_tree::delete_tree(Node* node) {
-    //In order to delete the entire tree, you must go from the bottom up, otherwise you will lose the pointers to the rest of the nodes
-	if (node->left != nullptr)
-		delete_tree(node->left);
-	if (node->right != nullptr)
-		delete_tree(node->right);
-	if (node != nullptr)
-		delete node;
+bool huffman_tree::encode_typed_blocks(const char *data, std::size_t size, std::size_t block_size, unsigned int thread_count, stream_mode streams, block_model models, std::vector<std::vector<uint8_t>> &blocks) {
+    //Counts each block and builds the model it would have on its own, then picks the type of each block and encodes it
+	std::size_t block_count = blocks.size();
+	unsigned int stream_count = streams == stream_mode::interleaved ? interleaved_stream_count : 1;
+	bool switching = models == block_model::switching;
+	std::vector<uint32_t> counts(switching ? block_count * stream_count * 256 : 0); //Histogram of each part of each block until the types are picked, a block fits in 32 bit counts
+	std::vector<uint8_t> lengths(block_count * 256); //Code lengths of the model of each block
+	std::vector<uint64_t> new_model_sizes(block_count); //Bytes each block takes with its own model
+	std::vector<uint8_t> types(block_count);
+	std::vector<std::size_t> model_blocks(block_count); //The block whose model encodes each block
+	auto pick_type = [&](std::size_t i, const uint32_t *block_counts, std::size_t model_block) { //model_block is the last block with its own model, block_count if none
+		std::size_t this_size = i + 1 < block_count ? block_size : size - i * block_size;
+		unsigned int symbol_count = 0;
+		for (unsigned int c = 0; c < 256; c++)
+			symbol_count += lengths[i * 256 + c] > 0;
+		uint64_t best_bytes = symbol_count == 1 ? 2 : new_model_sizes[i];
+		types[i] = symbol_count == 1 ? run_block : new_model_block;
+		if (1 + this_size <= best_bytes) {
+			types[i] = raw_block;
+			best_bytes = 1 + this_size;
+		}
+		bool reusable = model_block < block_count;
+		uint64_t reused_bytes = 1 + 8 * stream_count;
+		for (unsigned int j = 0; j < stream_count && reusable; j++) {
+			uint64_t bytes = 0;
+			reusable = payload_bytes(&lengths[model_block * 256], &block_counts[j * 256], bytes);
+			reused_bytes += bytes;
+		}
+		if (reusable && reused_bytes <= best_bytes)
+			types[i] = reused_model_block;
+		model_blocks[i] = types[i] == new_model_block ? i : model_block;
+	};
+	auto write_block = [&](std::size_t i, huffman_tree &tree, std::size_t &tree_block) { //tree holds the model of tree_block, and is rebuilt if block i needs another
+		std::size_t this_size = i + 1 < block_count ? block_size : size - i * block_size;
+		const char *block_data = data + i * block_size;
+		blocks[i].assign(1, types[i]);
+		if (types[i] == raw_block) {
+			blocks[i].insert(blocks[i].end(), block_data, block_data + this_size);
+			return true;
+		}
+		if (types[i] == run_block) {
+			blocks[i].push_back(static_cast<uint8_t>(block_data[0]));
+			return true;
+		}
+		if (model_blocks[i] != tree_block) {
+			tree_block = model_blocks[i];
+			tree = huffman_tree(std::vector<uint8_t>(&lengths[tree_block * 256], &lengths[tree_block * 256] + 256));
+		}
+		if (types[i] == new_model_block)
+			tree.append_model(blocks[i]);
+		return encode_payloads(tree, block_data, this_size, streams, blocks[i]);
+	};
+	std::atomic<std::size_t> next_block(0);
+	std::atomic<bool> failed(false);
+	auto build_models = [&]() { //With block_model::independent each block is encoded as soon as it is counted, while it is still in the cache
+		huffman_tree tree; //Rebuilt for each block, so its storage is allocated once per thread
+		std::size_t tree_block = block_count;
+		std::vector<uint32_t> own_counts(switching ? 0 : stream_count * 256);
+		for (std::size_t i = next_block++; i < block_count && !failed; i = next_block++) {
+			std::size_t this_size = i + 1 < block_count ? block_size : size - i * block_size;
+			std::size_t part_size = (this_size + stream_count - 1) / stream_count;
+			uint32_t *block_counts = switching ? &counts[i * stream_count * 256] : own_counts.data();
+			byte_histogram histogram = {};
+			for (unsigned int j = 0; j < stream_count; j++) {
+				std::size_t start = j * part_size < this_size ? j * part_size : this_size;
+				std::size_t end = start + part_size < this_size ? start + part_size : this_size;
+				uint64_t part_counts[256] = {};
+				count_bytes(data + i * block_size + start, end - start, part_counts);
+				for (unsigned int c = 0; c < 256; c++) {
+					block_counts[j * 256 + c] = static_cast<uint32_t>(part_counts[c]);
+					histogram[c] += part_counts[c];
+				}
+			}
+			tree.rebuild(histogram, code_mode::canonical, container_max_code_length);
+			tree_block = i;
+			uint64_t block_bytes = 1 + 2 + 8 * stream_count; //Type, symbol count and payload sizes
+			for (unsigned int c = 0; c < 256; c++) {
+				lengths[i * 256 + c] = tree.code_table[c].length;
+				block_bytes += tree.code_table[c].length > 0 ? 2 : 0;
+			}
+			for (unsigned int j = 0; j < stream_count; j++) {
+				uint64_t bytes = 0;
+				payload_bytes(&lengths[i * 256], &block_counts[j * 256], bytes);
+				block_bytes += bytes;
+			}
+			new_model_sizes[i] = block_bytes;
+			if (!switching) {
+				pick_type(i, block_counts, block_count);
+				if (!write_block(i, tree, tree_block))
+					failed = true;
+			}
+		}
+	};
+	run_threads(build_models, thread_count, block_count);
+	if (failed || !switching)
+		return !failed;
+	std::size_t model_block = block_count;
+	for (std::size_t i = 0; i < block_count; i++) { //In order, since a reused model comes from the blocks before
+		pick_type(i, &counts[i * stream_count * 256], model_block);
+		model_block = model_blocks[i];
+	}
+	next_block = 0;
+	auto encode_blocks = [&]() {
+		huffman_tree tree; //The model last used by this thread
+		std::size_t tree_block = block_count;
+		for (std::size_t i = next_block++; i < block_count && !failed; i = next_block++) {
+			if (!write_block(i, tree, tree_block))
+				failed = true;
+		}
+	};
+	run_threads(encode_blocks, thread_count, block_count);
+	return !failed;
+}
+
+bool huffman_tree::read_typed_blocks(const uint8_t *container, const std::vector<uint64_t> &offsets, uint64_t block_size, uint64_t original_size, std::vector<uint8_t> &model_lengths, std::vector<std::size_t> &block_models, std::vector<std::size_t> &payload_starts) {
+    //Reads the type of each block of a typed file and the models in order, 256 code lengths per model, so the blocks can then be decoded in any order
+	std::size_t block_count = offsets.size() - 1;
+	block_models.assign(block_count, 0);
+	payload_starts.assign(block_count, 1);
+	model_lengths.clear();
+	std::vector<uint8_t> lengths;
+	for (std::size_t i = 0; i < block_count; i++) {
+		const uint8_t *block = &container[static_cast<std::size_t>(offsets[i])];
+		std::size_t size = static_cast<std::size_t>(offsets[i + 1] - offsets[i]);
+		uint64_t expected_size = i + 1 < block_count ? block_size : original_size - i * block_size;
+		if (size == 0)
+			return false;
+		if (block[0] == new_model_block) {
+			if (!read_model(block, size, payload_starts[i], lengths))
+				return false;
+			model_lengths.insert(model_lengths.end(), lengths.begin(), lengths.end());
+		}
+		else if (block[0] == raw_block ? size - 1 != expected_size
+			: block[0] == run_block ? size != 2
+			: block[0] != reused_model_block || model_lengths.empty())
+			return false;
+		block_models[i] = model_lengths.empty() ? 0 : model_lengths.size() / 256 - 1; //Raw and run blocks before the first model get 0, which is never used
+	}
+	return true;
+}
+
+bool huffman_tree::payload_bytes(const uint8_t lengths[256], const uint32_t counts[256], uint64_t &bytes) {
+    //Finds the bytes of a payload holding counts[c] of each character c with codes of lengths[c] bits, false if a character in it has no code
+	uint64_t bits = 0;
+	for (unsigned int c = 0; c < 256; c++) {
+		if (counts[c] > 0 && lengths[c] == 0)
+			return false;
+		bits += static_cast<uint64_t>(counts[c]) * lengths[c];
+	}
+	bytes = bits / 8 + (bits % 8 != 0);
+	return true;
+}
+
+void huffman_tree::append_model(std::vector<uint8_t> &bytes) const {
+    //Writes the code lengths as (character, length) pairs for the characters in the tree
+	std::vector<uint8_t> lengths = code_lengths();
+	unsigned int symbol_count = 0;
+	for (unsigned int i = 0; i < 256; i++) {
+		if (lengths[i] > 0)
+			symbol_count++;
+	}
+	append_uint(bytes, symbol_count, 2);
+	for (unsigned int i = 0; i < 256; i++) {
+		if (lengths[i] > 0) {
+			bytes.push_back(static_cast<uint8_t>(i));
+			bytes.push_back(lengths[i]);
+		}
+	}
+}
+
+bool huffman_tree::read_model(const uint8_t *bytes, std::size_t size, std::size_t &position, std::vector<uint8_t> &lengths) {
+    //Reads a model written by append_model starting at position, and moves position past it
+	if (size < position + 2)
+		return false;
+	uint64_t symbol_count = read_uint(&bytes[position], 2);
+	position += 2;
+	if (symbol_count > 256 || size - position < 2 * symbol_count)
+		return false;
+	lengths.assign(256, 0);
+	for (uint64_t i = 0; i < symbol_count; i++, position += 2) {
+		if (bytes[position + 1] == 0 || bytes[position + 1] > 64 || lengths[bytes[position]] != 0) //Each character is listed once with a length that fits in 64 bits
+			return false;
+		lengths[bytes[position]] = bytes[position + 1];
+	}
+	return true;
+}
+
+bool huffman_tree::write_file(const std::string &file_name, const char *data, std::size_t size) {
+	std::ofstream output(file_name, std::ios::binary);
+	if (!output.is_open())
+		return false;
+	output.write(data, size);
+	return output.good();
+}
+
+void huffman_tree::run_threads(const std::function<void()> &work, unsigned int thread_count, std::size_t task_count) {
+    //Runs work on thread_count threads, or one per core if thread_count is zero, but never more threads than tasks
+	if (thread_count == 0)
+		thread_count = std::thread::hardware_concurrency() > 0 ? std::thread::hardware_concurrency() : 1;
+	if (thread_count > task_count)
+		thread_count = task_count > 0 ? static_cast<unsigned int>(task_count) : 1;
+	std::vector<std::thread> threads;
+	for (unsigned int i = 1; i < thread_count; i++)
+		threads.emplace_back(work);
+	work(); //The calling thread does its share too
+	for (unsigned int i = 0; i < threads.size(); i++)
+		threads[i].join();
+}
+
+void huffman_tree::read_file(const std::string &file_name) {
+    //Every byte is counted, including '\r' and a newline at the very end of the file
+	mapped_file file(file_name);
+	if (file.is_open())
+		count_bytes(file.data(), file.size(), frequencies);
+}
+
+void huffman_tree::count_bytes(const char *data, std::size_t size, uint64_t counts[256]) {
+    //Eight separate histograms fed from one 8 byte load, so consecutive equal bytes don't wait on each other's increments
+	const std::size_t max_chunk = std::size_t(1) << 30; //Few enough bytes that the 32 bit partial counts can't overflow
+	const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+	while (size > 0) {
+		std::size_t chunk = size < max_chunk ? size : max_chunk;
+		uint32_t partial[8][256] = {};
+		std::size_t i = 0;
+		for (; i + 8 <= chunk; i += 8) {
+			uint64_t word;
+			std::memcpy(&word, bytes + i, 8); //The order the bytes come out in doesn't matter for counting
+			partial[0][word & 0xFF]++;
+			partial[1][(word >> 8) & 0xFF]++;
+			partial[2][(word >> 16) & 0xFF]++;
+			partial[3][(word >> 24) & 0xFF]++;
+			partial[4][(word >> 32) & 0xFF]++;
+			partial[5][(word >> 40) & 0xFF]++;
+			partial[6][(word >> 48) & 0xFF]++;
+			partial[7][word >> 56]++;
+		}
+		for (; i < chunk; i++)
+			partial[0][bytes[i]]++;
+		for (unsigned int j = 0; j < 256; j++) {
+			counts[j] += static_cast<uint64_t>(partial[0][j]) + partial[1][j] + partial[2][j] + partial[3][j]
+				+ partial[4][j] + partial[5][j] + partial[6][j] + partial[7][j];
+		}
+		bytes += chunk;
+		size -= chunk;
+	}
+}
+
+double huffman_tree::entropy_bits(const uint64_t counts[256]) {
+    //Sums count * log2(total / count) over the characters, the Shannon bound in bits
+	uint64_t total = 0;
+	for (unsigned int i = 0; i < 256; i++)
+		total += counts[i];
+	double bits = 0;
+	for (unsigned int i = 0; i < 256; i++) {
+		if (counts[i] > 0)
+			bits += static_cast<double>(counts[i]) * std::log2(static_cast<double>(total) / static_cast<double>(counts[i]));
+	}
+	return bits;
+}
+
+uint16_t huffman_tree::merge_with_heap() {
+    //Joins the two nodes with the smallest frequencies until one is left, using a heap ordered by Compare
+	Node* heap[256]; //The nodes still without a parent, the smallest frequency is on top
+	unsigned int heap_size = 0;
+	for (unsigned int i = 0; i < node_count; i++) {
+		heap[heap_size++] = &nodes[i];
+		std::push_heap(heap, heap + heap_size, Compare());
+	}
+	while (heap_size > 1) {
+		std::pop_heap(heap, heap + heap_size--, Compare());
+		Node* left = heap[heap_size];
+		std::pop_heap(heap, heap + heap_size--, Compare());
+		Node* right = heap[heap_size];
+		Node* node = &nodes[node_count++];
+		*node = Node(); //Each node created here is not a leaf node, its character is never read
+		node->frequency = left->frequency + right->frequency;
+		node->left = static_cast<uint16_t>(left - nodes);
+		node->right = static_cast<uint16_t>(right - nodes);
+		heap[heap_size++] = node;
+		std::push_heap(heap, heap + heap_size, Compare());
+	}
+	return heap_size > 0 ? static_cast<uint16_t>(heap[0] - nodes) : Node::no_child;
+}
+
+uint16_t huffman_tree::merge_sorted_leaves() {
+    //Two-queue method: once the leaves are sorted, every new internal node has a frequency at least as large as the
+    //one before it, so the internal nodes form a second sorted queue and each merge takes the smaller fronts in O(1)
+	unsigned int leaf_count = node_count;
+	if (leaf_count == 0)
+		return Node::no_child;
+	uint16_t leaves[256];
+	for (unsigned int i = 0; i < leaf_count; i++)
+		leaves[i] = static_cast<uint16_t>(i);
+	std::sort(leaves, leaves + leaf_count, [this](uint16_t left, uint16_t right) {
+		return nodes[left].frequency < nodes[right].frequency || (nodes[left].frequency == nodes[right].frequency && left < right);
+	});
+	unsigned int next_leaf = 0;
+	unsigned int next_internal = leaf_count; //Internal nodes are added after the leaves, in the order they are made
+	auto take_smallest = [&]() -> uint16_t { //Prefers a leaf on ties, which keeps the longest code as short as possible
+		if (next_leaf < leaf_count && (next_internal == node_count || nodes[leaves[next_leaf]].frequency <= nodes[next_internal].frequency))
+			return leaves[next_leaf++];
+		return static_cast<uint16_t>(next_internal++);
+	};
+	for (unsigned int merges = 1; merges < leaf_count; merges++) {
+		uint16_t left = take_smallest();
+		uint16_t right = take_smallest();
+		Node &node = nodes[node_count++];
+		node = Node();
+		node.frequency = nodes[left].frequency + nodes[right].frequency;
+		node.left = left;
+		node.right = right;
+	}
+	return static_cast<uint16_t>(node_count - 1); //The last node made is the root, or the only leaf
+}
+
+void huffman_tree::limited_code_lengths(unsigned int max_code_length, uint8_t lengths[256]) {
+    //Package-merge: finds the code lengths with the fewest total bits among those no longer than max_code_length.
+    //Every level's list holds the leaves plus packages of pairs from the level below, both in order of frequency,
+    //and the 2n - 2 cheapest items of the top list give each leaf one bit of length for every time it is inside them.
+    //All levels are kept one after another in merge_items, which keeps its storage between rebuilds
+	uint16_t leaves[256];
+	unsigned int leaf_count = 0;
+	for (unsigned int i = 0; i < 256; i++) {
+		lengths[i] = 0;
+		if (frequencies[i] > 0)
+			leaves[leaf_count++] = static_cast<uint16_t>(i);
+	}
+	if (leaf_count == 1)
+		lengths[leaves[0]] = 1;
+	if (leaf_count <= 1)
+		return;
+	std::sort(leaves, leaves + leaf_count, [this](uint16_t left, uint16_t right) {
+		return frequencies[left] < frequencies[right] || (frequencies[left] == frequencies[right] && left < right);
+	});
+	unsigned int min_length = 1;
+	while ((1u << min_length) < leaf_count) //With shorter codes there wouldn't be enough codes to go around
+		min_length++;
+	if (max_code_length < min_length)
+		max_code_length = min_length;
+	merge_items.clear();
+	for (unsigned int i = 0; i < leaf_count; i++) { //The deepest level only holds leaves
+		merge_item leaf = { frequencies[leaves[i]], static_cast<int16_t>(leaves[i]), 0 };
+		merge_items.push_back(leaf);
+	}
+	std::size_t below_start = 0;
+	for (unsigned int level = 1; level < max_code_length; level++) {
+		std::size_t below_end = merge_items.size();
+		unsigned int next_leaf = 0;
+		for (std::size_t pair = below_start; pair + 1 < below_end; pair += 2) {
+			merge_item package = { merge_items[pair].frequency + merge_items[pair + 1].frequency, -1, static_cast<uint32_t>(pair) };
+			while (next_leaf < leaf_count && merge_items[next_leaf].frequency <= package.frequency)
+				merge_items.push_back(merge_items[next_leaf++]); //The first leaf_count items are the sorted leaves
+			merge_items.push_back(package);
+		}
+		while (next_leaf < leaf_count)
+			merge_items.push_back(merge_items[next_leaf++]);
+		below_start = below_end;
+	}
+	merge_pending.clear(); //Items still to be opened up, by their index in merge_items
+	for (std::size_t i = 0; i < 2 * leaf_count - 2; i++)
+		merge_pending.push_back(static_cast<uint32_t>(below_start + i));
+	while (!merge_pending.empty()) {
+		const merge_item &chosen = merge_items[merge_pending.back()];
+		merge_pending.pop_back();
+		if (chosen.symbol >= 0)
+			lengths[chosen.symbol]++;
+		else {
+			merge_pending.push_back(chosen.first_child);
+			merge_pending.push_back(chosen.first_child + 1);
+		}
+	}
+}
+
+void huffman_tree::encode_characters(uint16_t node, uint64_t bits, unsigned int length) {
+    //This function finds the code of each character and places it into code_table, so files can be more quickly encoded
+	if (nodes[node].leaf) { //A leaf node stores a character, so store that character along with the current code
+		code_table[nodes[node].character].bits = bits;
+		code_table[nodes[node].character].length = static_cast<uint8_t>(length < 255 ? length : 255); //Anything over 64 bits gets replaced by limited lengths
+	}
+	else { //Else, continue traversing down the tree, adding a zero if going to the left child and a 1 if going to the right child
+		if (nodes[node].left != Node::no_child)
+			encode_characters(nodes[node].left, bits << 1, length + 1);
+		if (nodes[node].right != Node::no_child)
+			encode_characters(nodes[node].right, (bits << 1) | 1, length + 1);
+	}
 	return;
 }
+
+bool huffman_tree::assign_canonical_codes(const uint8_t *code_lengths, std::size_t count) {
+    //Gives the shortest codes the smallest values, and codes of equal length consecutive values in character order
+	for (unsigned int i = 0; i < 256; i++) {
+		code_table[i].bits = 0;
+		code_table[i].length = 0;
+	}
+	if (count > 256)
+		return false;
+	for (std::size_t i = 0; i < count; i++) {
+		if (code_lengths[i] > 64) //Codes are stored in 64 bits
+			return false;
+	}
+	uint64_t code = 0;
+	unsigned int previous_length = 0;
+	bool used_up = false; //Every code of previous_length has been given out, and so has every longer code
+	for (unsigned int length = 1; length <= 64; length++) {
+		for (std::size_t i = 0; i < count; i++) {
+			if (code_lengths[i] != length)
+				continue;
+			if (previous_length != 0)
+				code <<= (length - previous_length); //Less than 64 bits, the first length is never shifted
+			previous_length = length;
+			if (used_up) { //The lengths are over-subscribed
+				for (unsigned int j = 0; j < 256; j++)
+					code_table[j].length = 0;
+				return false;
+			}
+			code_table[i].bits = code;
+			code_table[i].length = static_cast<uint8_t>(length);
+			code++;
+			used_up = length < 64 ? (code >> length) != 0 : code == 0; //64 bit codes are used up when code wraps around
+		}
+	}
+	return true;
+}
+
+void huffman_tree::build_decode_table() {
+    //Builds the tables from code_table alone, so they work for any set of prefix codes. Clearing keeps the
+    //table's storage, so rebuilding a tree of the same shape or smaller doesn't allocate
+	decode_table.clear();
+	decode_root_bits = 0;
+	multi_decode_table.clear();
+	uint16_t symbols[256];
+	unsigned int symbol_count = 0;
+	unsigned int max_length = 0;
+	for (unsigned int i = 0; i < 256; i++) {
+		if (code_table[i].length > 0) {
+			symbols[symbol_count++] = static_cast<uint16_t>(i);
+			if (code_table[i].length > max_length)
+				max_length = code_table[i].length;
+		}
+	}
+	if (symbol_count == 0)
+		return;
+	//Ordering the codes as left-aligned numbers puts every group of codes sharing a prefix next to each other
+	std::sort(symbols, symbols + symbol_count, [this](uint16_t left, uint16_t right) {
+		return (code_table[left].bits << (64 - code_table[left].length)) < (code_table[right].bits << (64 - code_table[right].length));
+	});
+	decode_root_bits = max_length < decode_table_bits ? max_length : decode_table_bits;
+	build_decode_subtable(symbols, symbol_count, 0, decode_root_bits);
+	build_multi_decode_table();
+}
+
+uint32_t huffman_tree::build_decode_subtable(const uint16_t *symbols, unsigned int count, unsigned int consumed, unsigned int bits) {
+    //symbols all share the same first consumed bits and are ordered by code, the table covers the next bits bits of their codes
+	uint32_t base = static_cast<uint32_t>(decode_table.size());
+	decode_entry invalid = { 0, 0, 0 };
+	decode_table.resize(base + (1u << bits), invalid);
+	unsigned int i = 0;
+	while (i < count) {
+		const code_entry &code = code_table[symbols[i]];
+		unsigned int remaining = code.length - consumed;
+		uint64_t tail = remaining < 64 ? code.bits & ((1ull << remaining) - 1) : code.bits;
+		if (remaining <= bits) { //The code ends here, so every entry starting with its remaining bits decodes it
+			uint32_t first = static_cast<uint32_t>(tail << (bits - remaining));
+			decode_entry entry = { symbols[i], static_cast<uint8_t>(remaining), 0 };
+			for (uint32_t j = 0; j < (1u << (bits - remaining)); j++)
+				decode_table[base + first + j] = entry;
+			i++;
+			continue;
+		}
+		//Codes that don't end in this table share an entry with the codes right after them that have the same next bits
+		uint32_t index = static_cast<uint32_t>(tail >> (remaining - bits));
+		unsigned int group_end = i;
+		unsigned int max_remaining = 0;
+		while (group_end < count) {
+			const code_entry &next = code_table[symbols[group_end]];
+			unsigned int next_remaining = next.length - consumed;
+			if (next_remaining <= bits)
+				break;
+			uint64_t next_tail = next_remaining < 64 ? next.bits & ((1ull << next_remaining) - 1) : next.bits;
+			if (static_cast<uint32_t>(next_tail >> (next_remaining - bits)) != index)
+				break;
+			if (next_remaining - bits > max_remaining)
+				max_remaining = next_remaining - bits;
+			group_end++;
+		}
+		unsigned int sub_bits = max_remaining < decode_table_bits ? max_remaining : decode_table_bits;
+		uint32_t sub_table = build_decode_subtable(symbols + i, group_end - i, consumed + bits, sub_bits);
+		decode_entry link = { sub_table, static_cast<uint8_t>(bits), static_cast<uint8_t>(sub_bits) };
+		decode_table[base + index] = link; //Assigned after the recursive call since resizing invalidates references
+		i = group_end;
+	}
+	return base;
+}
+
+void huffman_tree::build_multi_decode_table() {
+    //Fills each entry by decoding its window with the first table for as long as the next code ends inside it
+	multi_decode_table.clear();
+	if (decoding != decode_mode::multi_symbol || decode_table.empty())
+		return;
+	multi_decode_entry empty = { { 0, 0, 0, 0 }, 0, 0 };
+	multi_decode_table.resize(std::size_t(1) << multi_decode_bits, empty);
+	uint32_t window_mask = (1u << multi_decode_bits) - 1;
+	for (uint32_t window = 0; window <= window_mask; window++) {
+		multi_decode_entry &entry = multi_decode_table[window];
+		unsigned int used = 0;
+		while (entry.count < multi_decode_characters) {
+			uint32_t rest = (window << used) & window_mask; //The unused bits of the window, left aligned
+			const decode_entry &code = decode_table[rest >> (multi_decode_bits - decode_root_bits)];
+			if (code.sub_bits != 0 || code.length == 0 || code.length > multi_decode_bits - used)
+				break;
+			entry.characters[entry.count++] = static_cast<uint8_t>(code.value);
+			used += code.length;
+		}
+		entry.length = static_cast<uint8_t>(used);
+	}
+}
+
+uint32_t huffman_tree::crc32(const char *data, std::size_t size) {
+    //The CRC32 used by zip and PNG, computed a byte at a time from a table of the 256 possible byte remainders
+	static const std::vector<uint32_t> table = [] {
+		std::vector<uint32_t> remainders(256);
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t remainder = i;
+			for (unsigned int bit = 0; bit < 8; bit++)
+				remainder = (remainder & 1) ? (remainder >> 1) ^ 0xEDB88320u : remainder >> 1;
+			remainders[i] = remainder;
+		}
+		return remainders;
+	}();
+	uint32_t crc = 0xFFFFFFFFu;
+	for (std::size_t i = 0; i < size; i++)
+		crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFFu;
+}
+
+void huffman_tree::append_uint(std::vector<uint8_t> &bytes, uint64_t value, unsigned int byte_count) {
+	for (unsigned int i = 0; i < byte_count; i++)
+		bytes.push_back(static_cast<uint8_t>(value >> (8 * i)));
+}
+
+uint64_t huffman_tree::read_uint(const uint8_t *bytes, unsigned int byte_count) {
+	uint64_t value = 0;
+	for (unsigned int i = byte_count; i > 0; i--)
+		value = (value << 8) | bytes[i - 1];
+	return value;
+}
+
+/*
+Preconditions: output stays open for the life of the writer
+Postconditions: Constructs a writer that writes frames to output
+*/
+frame_writer::frame_writer(std::ostream &output) : output(output) {
+	pending.reserve(frame_size);
+}
+
+/*
+Postconditions: Encodes size characters from data. Complete frames are written to output
+				right away, the rest are held until the next write, flush or finish. Returns
+				false if a character can't be encoded, output fails, or finish was already called
+*/
+bool frame_writer::write(const char *data, std::size_t size) {
+	if (finished)
+		return false;
+	while (size > 0) {
+		if (pending.empty() && size >= frame_size) { //Whole frames can be encoded straight from data
+			if (!write_frame(data, frame_size))
+				return false;
+			data += frame_size;
+			size -= frame_size;
+			continue;
+		}
+		std::size_t count = frame_size - pending.size() < size ? frame_size - pending.size() : size;
+		pending.insert(pending.end(), data, data + count);
+		data += count;
+		size -= count;
+		if (pending.size() == frame_size) {
+			if (!write_frame(pending.data(), pending.size()))
+				return false;
+			pending.clear();
+		}
+	}
+	return true;
+}
+
+/*
+Preconditions: input is open, in binary mode for files
+Postconditions: Encodes everything left in input and then calls finish. Returns false
+				on the same failures as write and finish
+*/
+bool frame_writer::encode(std::istream &input) {
+	std::vector<char> buffer(frame_size);
+	while (input.read(buffer.data(), buffer.size()) || input.gcount() > 0) {
+		if (!write(buffer.data(), static_cast<std::size_t>(input.gcount())))
+			return false;
+	}
+	return finish();
+}
+
+/*
+Postconditions: Writes any held characters as a frame and flushes output, so a live stream
+				can be decoded up to here. Returns false if output fails or finish was already called
+*/
+bool frame_writer::flush() {
+	if (finished)
+		return false;
+	if (!pending.empty() && !write_frame(pending.data(), pending.size()))
+		return false;
+	pending.clear();
+	output.flush();
+	return output.good();
+}
+
+/*
+Postconditions: Writes any held characters and the end frame, and flushes output.
+				Nothing more can be written. Returns false if output fails
+*/
+bool frame_writer::finish() {
+	if (!flush())
+		return false;
+	finished = true;
+	frame_header.clear();
+	huffman_tree::append_uint(frame_header, 0, 8);
+	output.write(reinterpret_cast<const char*>(frame_header.data()), frame_header.size());
+	output.flush();
+	return output.good();
+}
+
+bool frame_writer::write_frame(const char *data, std::size_t size) {
+	if (!encode_frame(data, size, packed))
+		return false;
+	frame_header.clear();
+	huffman_tree::append_uint(frame_header, size, 4);
+	huffman_tree::append_uint(frame_header, packed.bit_count, 4);
+	output.write(reinterpret_cast<const char*>(frame_header.data()), frame_header.size());
+	output.write(reinterpret_cast<const char*>(packed.bytes.data()), packed.bytes.size());
+	return output.good();
+}
+
+/*
+Preconditions: input stays open for the life of the reader, max_code_length is the longest code
+				the encoder can write
+Postconditions: Constructs a reader that reads frames from input
+*/
+frame_reader::frame_reader(std::istream &input, unsigned int max_code_length) : input(input), max_code_length(max_code_length) {
+}
+
+/*
+Postconditions: Copies up to size decoded characters into buffer, reading more frames as
+				needed, and returns how many were copied. Returns 0 once the end frame is
+				reached or if the stream is damaged, failed() tells the two apart
+*/
+std::size_t frame_reader::read(char *buffer, std::size_t size) {
+	std::size_t copied = 0;
+	while (copied < size) {
+		if (decoded_position == decoded.size() && (ended || error || !read_frame()))
+			break;
+		std::size_t count = decoded.size() - decoded_position < size - copied ? decoded.size() - decoded_position : size - copied;
+		decoded.copy(buffer + copied, count, decoded_position);
+		decoded_position += count;
+		copied += count;
+	}
+	return copied;
+}
+
+/*
+Postconditions: Writes every remaining decoded character to output. Returns true if the
+				end frame was reached and output didn't fail
+*/
+bool frame_reader::decode(std::ostream &output) {
+	while (!ended && !error) {
+		if (decoded_position < decoded.size()) {
+			output.write(decoded.data() + decoded_position, decoded.size() - decoded_position);
+			decoded_position = decoded.size();
+		}
+		else
+			read_frame();
+	}
+	output.flush();
+	return !error && output.good();
+}
+
+bool frame_reader::at_end() const {
+	return ended && decoded_position == decoded.size();
+}
+
+bool frame_reader::failed() const {
+	return error;
+}
+
+bool frame_reader::read_frame() {
+    //Replaces decoded with the next frame, returns false at the end frame or on an error
+	uint8_t header[8];
+	if (!input.read(reinterpret_cast<char*>(header), sizeof(header))) {
+		error = true;
+		return false;
+	}
+	uint64_t size = huffman_tree::read_uint(header, 4);
+	packed.bit_count = huffman_tree::read_uint(header + 4, 4);
+	if (size == 0) {
+		ended = packed.bit_count == 0;
+		error = !ended;
+		return false;
+	}
+	if (size > frame_writer::frame_size || packed.bit_count < size || packed.bit_count > size * max_code_length) { //Limits memory use to what a real frame can need
+		error = true;
+		return false;
+	}
+	packed.bytes.resize(static_cast<std::size_t>((packed.bit_count + 7) / 8));
+	if (!input.read(reinterpret_cast<char*>(packed.bytes.data()), packed.bytes.size())
+		|| !decode_frame(packed, static_cast<std::size_t>(size), decoded) || decoded.size() != size) {
+		error = true;
+		return false;
+	}
+	decoded_position = 0;
+	return true;
+}
+
+/*
+Preconditions: tree has a code for every character that will be written, and output
+				stays open for the life of the encoder
+Postconditions: Constructs an encoder that writes frames to output
+*/
+huffman_encoder::huffman_encoder(const huffman_tree &tree, std::ostream &output) : frame_writer(output), tree(tree) {
+}
+
+bool huffman_encoder::encode_frame(const char *data, std::size_t size, packed_bits &packed) {
+	return tree.encode_bytes(data, size, packed);
+}
+
+/*
+Preconditions: tree has the same codes as the tree given to the huffman_encoder, and input
+				stays open for the life of the decoder
+Postconditions: Constructs a decoder that reads frames from input
+*/
+huffman_decoder::huffman_decoder(const huffman_tree &tree, std::istream &input) : frame_reader(input, 64), tree(tree) {
+}
+
+bool huffman_decoder::decode_frame(const packed_bits &packed, std::size_t, std::string &decoded) {
+	return tree.decode_into(packed.bytes.data(), packed.bytes.size(), packed.bit_count, decoded);
+}
+
+/*
+Postconditions: Constructs a model whose tree is only the NYT leaf
+*/
+adaptive_huffman_model::adaptive_huffman_model() {
+	for (unsigned int i = 0; i < 256; i++)
+		leaves[i] = none;
+	for (unsigned int i = 0; i < max_nodes; i++)
+		by_number[i] = none;
+	adaptive_node first = { 0, none, { none, none }, static_cast<uint16_t>(max_nodes - 1), -1 };
+	nodes[0] = first;
+	by_number[max_nodes - 1] = 0;
+	node_count = 1;
+	root = 0;
+	nyt = 0;
+}
+
+/*
+Preconditions: writer has room for max_code_length more bits
+Postconditions: Writes the code of character, then updates the tree for it
+*/
+void adaptive_huffman_model::encode(unsigned char character, bit_writer &writer) {
+	uint16_t node = leaves[character] != none ? leaves[character] : nyt;
+	uint8_t path[max_nodes]; //The code read from the leaf up, so it is written backwards
+	unsigned int length = 0;
+	for (; node != root; node = nodes[node].parent)
+		path[length++] = nodes[nodes[node].parent].children[1] == node ? 1 : 0;
+	while (length > 0) { //Writes the code from the root down, up to 56 bits at a time
+		unsigned int count = length < 56 ? length : 56;
+		uint64_t bits = 0;
+		for (unsigned int i = 0; i < count; i++)
+			bits = (bits << 1) | path[--length];
+		writer.write(bits, count);
+	}
+	if (leaves[character] == none)
+		writer.write(character, 8);
+	update(character);
+}
+
+/*
+Preconditions: reader is at the start of a code written by encode from a model in the same state
+Postconditions: Reads the code, updates the tree and returns the character, or returns -1 if
+				the code would pass bit_count or brings in a character that was already seen
+*/
+int adaptive_huffman_model::decode(bit_reader &reader, uint64_t bit_count) {
+	uint16_t node = root;
+	while (!is_leaf(node)) {
+		if (reader.position() >= bit_count)
+			return -1;
+		if (reader.available() == 0)
+			reader.refill();
+		unsigned int bit = static_cast<unsigned int>(reader.peek(1));
+		reader.skip(1);
+		node = nodes[node].children[bit];
+	}
+	int character = nodes[node].character;
+	if (node == nyt) {
+		if (bit_count - reader.position() < 8 || bit_count < reader.position())
+			return -1;
+		if (reader.available() < 8)
+			reader.refill();
+		character = static_cast<int>(reader.peek(8));
+		reader.skip(8);
+		if (leaves[character] != none)
+			return -1;
+	}
+	update(static_cast<unsigned char>(character));
+	return character;
+}
+
+bool adaptive_huffman_model::is_leaf(uint16_t node) const {
+	return nodes[node].children[0] == none;
+}
+
+void adaptive_huffman_model::update(unsigned char character) {
+    //Vitter's update. Nodes are kept in order of weight with every leaf before the internal nodes of the same
+    //weight, and each node on the path to the root is slid past the nodes it outgrows before its weight goes up
+	uint16_t leaf_to_increment = none;
+	uint16_t node = leaves[character];
+	if (node == none && seen < 255) { //The NYT becomes an internal node with a new NYT and the new leaf below it
+		uint16_t number = nodes[nyt].number;
+		uint16_t new_nyt = node_count++;
+		uint16_t leaf = node_count++;
+		adaptive_node nyt_node = { 0, nyt, { none, none }, static_cast<uint16_t>(number - 2), -1 };
+		adaptive_node leaf_node = { 0, nyt, { none, none }, static_cast<uint16_t>(number - 1), static_cast<int16_t>(character) };
+		nodes[new_nyt] = nyt_node;
+		nodes[leaf] = leaf_node;
+		by_number[number - 2] = new_nyt;
+		by_number[number - 1] = leaf;
+		nodes[nyt].children[0] = new_nyt;
+		nodes[nyt].children[1] = leaf;
+		leaves[character] = leaf;
+		seen++;
+		node = nyt;
+		nyt = new_nyt;
+		leaf_to_increment = leaf;
+	}
+	else {
+		if (node == none) { //The last character not yet seen takes over the NYT, which is no longer needed
+			node = nyt;
+			nodes[node].character = static_cast<int16_t>(character);
+			leaves[character] = node;
+			nyt = none;
+			seen++;
+		}
+		uint16_t leader = node; //The highest numbered leaf of the same weight
+		while (nodes[leader].number + 1u < max_nodes) {
+			uint16_t next = by_number[nodes[leader].number + 1];
+			if (!is_leaf(next) || nodes[next].weight != nodes[node].weight)
+				break;
+			leader = next;
+		}
+		if (leader != node)
+			swap_nodes(node, leader);
+		uint16_t parent = nodes[node].parent;
+		if (nyt != none && parent != none && nodes[nyt].parent == parent) { //The parent has the same weight, so it goes first
+			leaf_to_increment = node;
+			node = parent;
+		}
+	}
+	while (node != none)
+		node = slide_and_increment(node);
+	if (leaf_to_increment != none)
+		slide_and_increment(leaf_to_increment);
+}
+
+uint16_t adaptive_huffman_model::slide_and_increment(uint16_t node) {
+    //Moves node past the nodes that would be out of order once its weight goes up: the nodes of its weight,
+    //and for an internal node also the leaves of the weight it is going up to. Returns the next node to update
+	uint64_t weight = nodes[node].weight;
+	uint16_t former_parent = nodes[node].parent;
+	bool leaf = is_leaf(node);
+	while (nodes[node].number + 1u < max_nodes) {
+		uint16_t next = by_number[nodes[node].number + 1];
+		if (nodes[next].weight != weight && !(!leaf && is_leaf(next) && nodes[next].weight == weight + 1))
+			break;
+		swap_nodes(node, next);
+	}
+	nodes[node].weight++;
+	return leaf ? nodes[node].parent : former_parent;
+}
+
+void adaptive_huffman_model::swap_nodes(uint16_t first, uint16_t second) {
+    //Exchanges the places of two nodes in the tree along with their subtrees, and their numbers
+	uint16_t first_parent = nodes[first].parent;
+	uint16_t second_parent = nodes[second].parent;
+	unsigned int first_side = nodes[first_parent].children[1] == first ? 1 : 0;
+	unsigned int second_side = nodes[second_parent].children[1] == second ? 1 : 0;
+	nodes[first_parent].children[first_side] = second;
+	nodes[second_parent].children[second_side] = first;
+	nodes[first].parent = second_parent;
+	nodes[second].parent = first_parent;
+	std::swap(nodes[first].number, nodes[second].number);
+	by_number[nodes[first].number] = first;
+	by_number[nodes[second].number] = second;
+}
+
+/*
+Preconditions: output stays open for the life of the encoder
+Postconditions: Constructs an encoder that writes frames to output, starting from an empty model
+*/
+adaptive_huffman_encoder::adaptive_huffman_encoder(std::ostream &output) : frame_writer(output) {
+}
+
+bool adaptive_huffman_encoder::encode_frame(const char *data, std::size_t size, packed_bits &packed) {
+    //Encodes with the model as it stands and updates it, so the next frame carries on from here
+	packed.bytes.clear();
+	bit_writer writer(packed.bytes);
+	for (std::size_t i = 0; i < size; i++) {
+		writer.reserve(adaptive_huffman_model::max_code_length);
+		model.encode(static_cast<unsigned char>(data[i]), writer);
+	}
+	packed.bit_count = writer.bit_count();
+	writer.finish();
+	return true;
+}
+
+/*
+Preconditions: input holds frames written by an adaptive_huffman_encoder and stays open for the
+				life of the decoder
+Postconditions: Constructs a decoder that reads frames from input, starting from an empty model
+*/
+adaptive_huffman_decoder::adaptive_huffman_decoder(std::istream &input) : frame_reader(input, adaptive_huffman_model::max_code_length) {
+}
+
+bool adaptive_huffman_decoder::decode_frame(const packed_bits &packed, std::size_t size, std::string &decoded) {
+    //Decodes size characters, which must use exactly the frame's code bits with zero padding after them
+	if (packed.bit_count % 8 != 0 && (packed.bytes.back() & (0xFF >> (packed.bit_count % 8))) != 0)
+		return false;
+	decoded.resize(size);
+	bit_reader reader(packed.bytes.data(), packed.bytes.size());
+	for (std::size_t i = 0; i < size; i++) {
+		int character = model.decode(reader, packed.bit_count);
+		if (character < 0)
+			return false;
+		decoded[i] = static_cast<char>(character);
+	}
+	return reader.position() == packed.bit_count;
+}
+
+/*
+Preconditions: file_name is the name of (and possibly path to) a file
+Postconditions: Makes the contents of file_name available through data() and size(). Regular
+				files are memory mapped for sequential reading where the system supports it,
+				anything else is read into memory. is_open() is false if the file can't be read
+*/
+mapped_file::mapped_file(const std::string &file_name) {
+#ifdef HUFFMAN_TREE_USE_MMAP
+	int descriptor = ::open(file_name.c_str(), O_RDONLY);
+	if (descriptor >= 0) {
+		struct stat information;
+		bool regular = fstat(descriptor, &information) == 0 && S_ISREG(information.st_mode);
+		if (regular && information.st_size == 0) //An empty file can't be mapped, but there is nothing to read either
+			opened = true;
+		else if (regular) {
+			void *address = mmap(nullptr, static_cast<std::size_t>(information.st_size), PROT_READ, MAP_PRIVATE, descriptor, 0);
+			if (address != MAP_FAILED) {
+				madvise(address, static_cast<std::size_t>(information.st_size), MADV_SEQUENTIAL); //Lets the kernel read ahead and drop pages behind
+				mapping = static_cast<const char*>(address);
+				mapped_size = static_cast<std::size_t>(information.st_size);
+				opened = true;
+			}
+		}
+		if (!opened) { //Pipes and other files that can't be mapped are read through the descriptor already open, reopening a FIFO would lose its writer
+			char chunk[1 << 16];
+			ssize_t count;
+			while ((count = ::read(descriptor, chunk, sizeof(chunk))) != 0) {
+				if (count < 0 && errno != EINTR)
+					break;
+				if (count > 0)
+					buffer.insert(buffer.end(), chunk, chunk + count);
+			}
+			opened = count == 0;
+			if (!opened)
+				buffer.clear();
+		}
+		close(descriptor); //The mapping stays valid without the descriptor
+		return;
+	}
+#endif
+	std::ifstream file(file_name, std::ios::binary);
+	if (file.is_open()) {
+		buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		opened = true;
+	}
+}
+
+mapped_file::~mapped_file() {
+#ifdef HUFFMAN_TREE_USE_MMAP
+	if (mapping != nullptr)
+		munmap(const_cast<char*>(mapping), mapped_size);
+#endif
+}
+
+bool mapped_file::is_open() const {
+	return opened;
+}
+
+const char *mapped_file::data() const {
+	return mapping != nullptr ? mapping : buffer.data();
+}
+
+std::size_t mapped_file::size() const {
+	return mapping != nullptr ? mapped_size : buffer.size();
+}
@@ -3,38 +3,489 @@
 #include <iostream>
 #include <fstream>
 #include <string>
-#include <map>
-#include <queue>
+#include <algorithm>
 #include <vector>
+#include <cstdint>
+#include <iterator>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <array>
+#include <cstring>
+#include <cmath>
 
 
 struct Node {
-	Node(char character_ = -64, int frequency_ = 0); //Default parameters that set character to -64 and frequency to zero, any char value between -1 and -128 would work as the character
-	char character;
-	int frequency;
-	Node* right;
-	Node* left;
+	Node(unsigned char character_ = 0, uint64_t frequency_ = 0, bool leaf_ = false); //Default parameters make an internal node, every byte value is a valid character so leaves are marked explicitly
+	unsigned char character;
+	uint64_t frequency;
+	bool leaf; //True if the node stores a character, false for internal nodes
+	uint16_t right; //Index of the child in the tree's node array, no_child if there is none
+	uint16_t left;
+	static const uint16_t no_child = 0xFFFF;
 };
 
 struct Compare {
-	bool operator()(const Node* left, const Node* right) const; //Comparison class so that the nodes can be placed into a priority queue
+	bool operator()(const Node* left, const Node* right) const; //Comparison class so that the nodes can be placed into a heap
 };
 
+struct packed_bits {
+	std::vector<uint8_t> bytes; //Code bits packed most significant bit first, the unused bits of the last byte are zero
+	uint64_t bit_count = 0; //The exact number of code bits stored in bytes
+};
+
+struct size_estimate {
+	uint64_t huffman_bits = 0; //Exact number of code bits for every character counted, the sum of count times code length
+	double entropy_bits = 0; //Shannon bound, no code for the same counts can take fewer bits
+};
+
+//Packs codes most significant bit first onto the end of a byte vector. Codes are ORed into a 64-bit
+//accumulator and every write stores all 8 bytes of it at once, then moves past the complete bytes only.
+//Everything is defined in this header so a writer local to an encoding loop can live in registers
+class bit_writer {
+public:
+	bit_writer(std::vector<uint8_t> &bytes);
+
+	void reserve(uint64_t bit_count);
+	void write(uint64_t bits, unsigned int length);
+	uint64_t bit_count() const;
+	void finish();
+private:
+	std::vector<uint8_t> &bytes;
+	uint8_t *buffer; //bytes.data() as of the last reserve
+	std::size_t start; //Size of bytes before the first write
+	std::size_t position; //Index in bytes of the byte the accumulator starts at
+	uint64_t accumulator = 0; //Bits not yet past a complete byte, left aligned
+	unsigned int accumulated = 0; //Always less than 8 between writes
+	void append(uint64_t bits, unsigned int length);
+};
+
+/*
+Postconditions: Constructs a writer that appends bits after the current contents of bytes
+*/
+inline bit_writer::bit_writer(std::vector<uint8_t> &bytes) : bytes(bytes), buffer(bytes.data()), start(bytes.size()), position(bytes.size()) {
+}
+
+/*
+Postconditions: Makes room for bit_count more bits, which must be done before they are written
+*/
+inline void bit_writer::reserve(uint64_t bit_count) {
+	std::size_t needed = position + static_cast<std::size_t>(bit_count / 8) + 16; //Each write stores 8 bytes, 7 of them can be past its last bit
+	if (bytes.size() < needed)
+		bytes.resize(needed);
+	buffer = bytes.data();
+}
+
+/*
+Preconditions: bits holds a code of length bits right aligned, with nothing above it, and the room
+				for it has been reserved. length is at most 64
+Postconditions: Appends the code, with no branch on how many bytes are complete
+*/
+inline void bit_writer::write(uint64_t bits, unsigned int length) {
+	if (length > 56) { //After a write at most 7 bits remain, so longer codes are written in two parts
+		append(bits >> 32, length - 32);
+		bits &= 0xFFFFFFFFull;
+		length = 32;
+	}
+	append(bits, length);
+}
+
+inline void bit_writer::append(uint64_t bits, unsigned int length) {
+	accumulator |= bits << (64 - accumulated - length);
+	accumulated += length;
+	uint64_t big_endian = accumulator;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	big_endian = __builtin_bswap64(big_endian);
+#elif !defined(__BYTE_ORDER__)
+	uint8_t ordered[8];
+	for (unsigned int i = 0; i < 8; i++)
+		ordered[i] = static_cast<uint8_t>(accumulator >> (56 - 8 * i));
+	std::memcpy(&big_endian, ordered, 8);
+#endif
+	std::memcpy(buffer + position, &big_endian, 8); //Stores every byte, complete or not, in one unaligned store
+	unsigned int complete = accumulated / 8;
+	position += complete;
+	accumulator <<= 8 * complete;
+	accumulated -= 8 * complete;
+}
+
+/*
+Postconditions: Returns the number of bits written so far
+*/
+inline uint64_t bit_writer::bit_count() const {
+	return static_cast<uint64_t>(position - start) * 8 + accumulated;
+}
+
+/*
+Postconditions: Trims bytes to end at the last bit written, the unused bits of the last byte are zero
+*/
+inline void bit_writer::finish() {
+	if (bytes.size() < position + 1)
+		bytes.resize(position + 1);
+	bytes[position] = static_cast<uint8_t>(accumulator >> 56);
+	bytes.resize(position + (accumulated > 0 ? 1 : 0));
+}
+
+//Reads bits most significant bit first, refilling a 64-bit window from 8 bytes at a time so that
+//at least 56 bits can be used between refills. Bits past the end of the bytes read as zero
+class bit_reader {
+public:
+	bit_reader(const uint8_t *bytes, std::size_t byte_count);
+
+	void refill();
+	unsigned int available() const;
+	uint64_t peek(unsigned int count) const;
+	void skip(unsigned int count);
+	uint64_t position() const;
+private:
+	const uint8_t *bytes;
+	std::size_t byte_count;
+	uint64_t bit_position = 0; //Bits used so far, the window starts here
+	uint64_t window = 0; //The next bits, left aligned
+	unsigned int window_bits = 0; //Number of valid bits in the window
+};
+
+/*
+Preconditions: bytes points to byte_count bytes that stay valid for the life of the reader
+Postconditions: Constructs a reader starting at the first bit of bytes
+*/
+inline bit_reader::bit_reader(const uint8_t *bytes, std::size_t byte_count) : bytes(bytes), byte_count(byte_count) {
+	refill();
+}
+
+/*
+Postconditions: Fills the window from the current position, leaving at least 57 bits available
+*/
+inline void bit_reader::refill() {
+	std::size_t index = static_cast<std::size_t>(bit_position / 8);
+	uint64_t loaded = 0;
+	if (byte_count >= 8 && index <= byte_count - 8) {
+		std::memcpy(&loaded, bytes + index, 8); //One unaligned load of the next 8 bytes
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		loaded = __builtin_bswap64(loaded);
+#elif !defined(__BYTE_ORDER__)
+		const uint8_t *next = bytes + index;
+		loaded = 0;
+		for (unsigned int i = 0; i < 8; i++)
+			loaded = (loaded << 8) | next[i];
+#endif
+	}
+	else {
+		for (unsigned int i = 0; i < 8; i++)
+			loaded = (loaded << 8) | (index + i < byte_count ? bytes[index + i] : 0);
+	}
+	unsigned int offset = static_cast<unsigned int>(bit_position % 8);
+	window = loaded << offset;
+	window_bits = 64 - offset;
+}
+
+/*
+Postconditions: Returns the number of bits that can be peeked or skipped before the next refill
+*/
+inline unsigned int bit_reader::available() const {
+	return window_bits;
+}
+
+/*
+Preconditions: count is between 1 and available()
+Postconditions: Returns the next count bits without using them
+*/
+inline uint64_t bit_reader::peek(unsigned int count) const {
+	return window >> (64 - count);
+}
+
+/*
+Preconditions: count is at most available() and less than 64
+Postconditions: Moves past the next count bits
+*/
+inline void bit_reader::skip(unsigned int count) {
+	window <<= count;
+	window_bits -= count;
+	bit_position += count;
+}
+
+/*
+Postconditions: Returns the number of bits used so far
+*/
+inline uint64_t bit_reader::position() const {
+	return bit_position;
+}
+
+typedef std::array<uint64_t, 256> byte_histogram; //The number of times each character appears, indexed by its unsigned value
+
+enum class code_mode {
+	tree, //Codes follow the paths through the Huffman tree
+	canonical //Codes are assigned from the code lengths alone, in order of length and then character
+};
+
+enum class stream_mode {
+	single, //Each block is one bit stream
+	interleaved //Each block is split into 4 bit streams that are decoded side by side
+};
+
+enum class block_model {
+	independent, //Every block has its own model, or is stored raw or as a run if that is smaller
+	switching //Each block may also reuse the model of the block before it, whichever is smallest
+};
+
+enum class decode_mode {
+	single_symbol, //Each table lookup decodes one character
+	multi_symbol //Each lookup decodes every whole code in the next 11 bits, up to 4 characters
+};
+
+class frame_writer;
+class frame_reader;
+class huffman_encoder;
+class huffman_decoder;
+
 class huffman_tree {
 public:
-	huffman_tree(const std::string &file_name);
-	~huffman_tree();
+	huffman_tree(const std::string &file_name, code_mode mode = code_mode::tree, unsigned int max_code_length = 0);
+	huffman_tree(const char *data, std::size_t size, code_mode mode = code_mode::tree, unsigned int max_code_length = 0);
+	huffman_tree(const byte_histogram &counts, code_mode mode = code_mode::tree, unsigned int max_code_length = 0);
+	huffman_tree(const std::vector<uint8_t> &code_lengths);
+	huffman_tree();
+
+	void rebuild(const byte_histogram &counts, code_mode mode = code_mode::tree, unsigned int max_code_length = 0);
+	void reset();
+	void set_decode_mode(decode_mode mode);
 
 	std::string get_character_code(char character) const;
+	std::vector<uint8_t> code_lengths() const;
+	size_estimate encoded_size() const;
 	std::string encode(const std::string &file_name) const;
+	packed_bits encode_packed(const std::string &file_name) const;
+	packed_bits encode_packed(const char *data, std::size_t size) const;
 	std::string decode(const std::string &string_to_decode) const;
+	std::string decode(const packed_bits &packed) const;
+	std::string decode(const uint8_t *bytes, std::size_t byte_count, uint64_t bit_count) const;
+
+	static size_estimate estimate_compressed_bits(const byte_histogram &counts);
+	static bool compress_file(const std::string &input_file_name, const std::string &output_file_name);
+	static bool compress_file(const std::string &input_file_name, const std::string &output_file_name, std::size_t block_size, unsigned int thread_count = 0, stream_mode streams = stream_mode::single, block_model models = block_model::independent);
+	static bool decompress_file(const std::string &input_file_name, const std::string &output_file_name, unsigned int thread_count = 0);
+	static bool compress(const char *data, std::size_t size, std::vector<uint8_t> &container);
+	static bool compress(const char *data, std::size_t size, std::vector<uint8_t> &container, std::size_t block_size, unsigned int thread_count = 0, stream_mode streams = stream_mode::single, block_model models = block_model::independent);
+	static bool decompress(const uint8_t *container, std::size_t size, std::string &data, unsigned int thread_count = 0);
+	static bool decompress_range(const std::string &input_file_name, uint64_t offset, uint64_t length, std::string &data);
 private:
-	std::map<char, int> frequencies; //Store any characters from the file in here, mapped to their frequency in the file
-	std::map<char, std::string> encoded_chars; //Store the characters mapped to their codes in here
-	std::priority_queue<Node*, std::vector<Node*>, Compare> node_queue; //A priority queue to make the Huffman tree
+	friend class frame_writer;
+	friend class frame_reader;
+	friend class huffman_encoder;
+	friend class huffman_decoder;
+	uint64_t frequencies[256] = {}; //The number of times each character appears in the file, indexed by its unsigned value
+	static const unsigned int max_nodes = 2 * 256 - 1; //A full binary tree with 256 leaves has 255 internal nodes
+	Node nodes[max_nodes]; //Every node of the tree, children refer to each other by index so no node is allocated on its own
+	uint16_t node_count = 0;
+	uint16_t root = Node::no_child; //Index of the root in nodes, no_child if the tree is empty
+	struct code_entry {
+		uint64_t bits; //The code right aligned, so the last bit of the code is the least significant bit
+		uint8_t length; //Number of bits in the code, zero if the character is not in the tree
+	};
+	code_entry code_table[256] = {}; //The code of each character indexed by its unsigned value, so finding a code is a single load
+	struct decode_entry {
+		uint32_t value; //The decoded character, or the start of the next table if sub_bits is not zero
+		uint8_t length; //Number of bits used by this entry, zero marks a bit pattern that is not a valid code
+		uint8_t sub_bits; //Number of bits indexing the next table, zero for entries that decode a character
+	};
+	static const unsigned int decode_table_bits = 11; //Most bits looked up at once, 2^11 entries keeps the first table small enough for the L1 cache
+	std::vector<decode_entry> decode_table; //All lookup tables for decode, the first table starts at index 0
+	unsigned int decode_root_bits = 0; //Number of bits indexing the first table
+	struct multi_decode_entry {
+		uint8_t characters[4]; //The characters decoded, in order
+		uint8_t count; //Number of characters, zero if the first code doesn't end within the window
+		uint8_t length; //Number of bits used by all of them
+	};
+	static const unsigned int multi_decode_bits = decode_table_bits; //Bits looked up at once in multi_decode_table
+	static const unsigned int multi_decode_characters = 4;
+	decode_mode decoding = decode_mode::single_symbol;
+	std::vector<multi_decode_entry> multi_decode_table; //Empty unless decoding is decode_mode::multi_symbol and the tree has codes
+	static const std::size_t multi_decode_min_size = 1 << 15; //Containers with fewer characters than this aren't worth building the table for
+	struct merge_item {
+		uint64_t frequency;
+		int16_t symbol; //The character of a leaf, -1 for a package
+		uint32_t first_child; //Index in merge_items of the first of the two items in a package, the second follows it
+	};
+	std::vector<merge_item> merge_items; //Scratch lists for limited_code_lengths, kept so rebuilding doesn't allocate them again
+	std::vector<uint32_t> merge_pending;
+	static const uint8_t container_version = 1; //Written after the magic number "HUFZ" or "HUFB" at the start of compressed files
+	static const uint8_t interleaved_container_version = 2; //Written instead for "HUFB" files whose blocks are split into streams
+	static const uint8_t typed_container_version = 3; //Written instead for "HUFB" files whose blocks start with their type
+	static const uint8_t typed_interleaved_container_version = 4; //Both of the above
+	static const unsigned int interleaved_stream_count = 4;
+	static const uint8_t new_model_block = 0; //First byte of each block of a typed file, the block has its own model
+	static const uint8_t reused_model_block = 1; //The block uses the model of the last block that had one
+	static const uint8_t raw_block = 2; //The block holds its characters as they are
+	static const uint8_t run_block = 3; //The block is one character repeated, stored once
+	static const std::size_t max_block_size = 1 << 28; //Largest block size accepted for block compressed files
+	static const std::size_t block_header_size = 17; //Bytes before the index of a block compressed file
+	static const unsigned int container_max_code_length = 15; //Code length limit for compressed files, keeps every decode table small
+	void build_tree(code_mode mode, unsigned int max_code_length = 0);
 	void read_file(const std::string &file_name);
-	void encode_characters(std::string code, Node* node);
-	void delete_tree(Node* node);
+	bool encode_bytes(const char *data, std::size_t size, packed_bits &packed) const;
+	bool decode_into(const uint8_t *bytes, std::size_t byte_count, uint64_t bit_count, std::string &decoded) const;
+	bool decode_interleaved(const uint8_t *const bytes[], const std::size_t byte_counts[], const uint64_t bit_counts[], char *output, std::size_t size) const;
+	static int decode_symbol(bit_reader &reader, const decode_entry *table, unsigned int root_bits);
+	static int decode_refilled_symbol(bit_reader &reader, const decode_entry *table, unsigned int root_bits);
+	static void count_bytes(const char *data, std::size_t size, uint64_t counts[256]);
+	static double entropy_bits(const uint64_t counts[256]);
+	uint16_t merge_with_heap();
+	uint16_t merge_sorted_leaves();
+	void limited_code_lengths(unsigned int max_code_length, uint8_t lengths[256]);
+	void encode_characters(uint16_t node, uint64_t bits, unsigned int length);
+	bool assign_canonical_codes(const uint8_t *code_lengths, std::size_t count);
+	void build_decode_table();
+	void build_multi_decode_table();
+	uint32_t build_decode_subtable(const uint16_t *symbols, unsigned int count, unsigned int consumed, unsigned int bits);
+	void append_model(std::vector<uint8_t> &bytes) const;
+	static bool read_model(const uint8_t *bytes, std::size_t size, std::size_t &position, std::vector<uint8_t> &lengths);
+	static bool decode_container(const uint8_t *container, std::size_t size, std::string &data);
+	static bool decode_block_container(const uint8_t *container, std::size_t size, std::string &data, unsigned int thread_count);
+	static bool read_block_index(const uint8_t *header, std::size_t size, uint64_t file_size, uint64_t block_size, uint64_t original_size, bool typed, std::vector<uint64_t> &offsets);
+	static bool read_block_version(uint8_t version, stream_mode &streams, bool &typed);
+	static bool decode_block(const uint8_t *block, std::size_t size, stream_mode streams, uint64_t original_size, std::string &data);
+	static bool encode_payloads(const huffman_tree &tree, const char *data, std::size_t size, stream_mode streams, std::vector<uint8_t> &block);
+	static bool decode_payloads(const huffman_tree &tree, const uint8_t *block, std::size_t size, stream_mode streams, uint64_t original_size, std::string &data);
+	static bool encode_typed_blocks(const char *data, std::size_t size, std::size_t block_size, unsigned int thread_count, stream_mode streams, block_model models, std::vector<std::vector<uint8_t>> &blocks);
+	static bool read_typed_blocks(const uint8_t *container, const std::vector<uint64_t> &offsets, uint64_t block_size, uint64_t original_size, std::vector<uint8_t> &model_lengths, std::vector<std::size_t> &block_models, std::vector<std::size_t> &payload_starts);
+	static bool payload_bytes(const uint8_t lengths[256], const uint32_t counts[256], uint64_t &bytes);
+	static bool write_file(const std::string &file_name, const char *data, std::size_t size);
+	static void run_threads(const std::function<void()> &work, unsigned int thread_count, std::size_t task_count);
+	static uint32_t crc32(const char *data, std::size_t size);
+	static void append_uint(std::vector<uint8_t> &bytes, uint64_t value, unsigned int byte_count);
+	static uint64_t read_uint(const uint8_t *bytes, unsigned int byte_count);
+};
+
+//Read-only view of a whole file, memory mapped where possible so input files are not copied
+class mapped_file {
+public:
+	mapped_file(const std::string &file_name);
+	~mapped_file();
+	mapped_file(const mapped_file &) = delete;
+	mapped_file &operator=(const mapped_file &) = delete;
+
+	bool is_open() const;
+	const char *data() const;
+	std::size_t size() const;
+private:
+	const char *mapping = nullptr; //Start of the mapped file, nullptr if the file was read into buffer instead
+	std::size_t mapped_size = 0;
+	std::vector<char> buffer;
+	bool opened = false;
+};
+
+//Streams are split into frames so memory use doesn't depend on the stream length. Each frame is
+//the number of characters (4 bytes), the number of code bits (4 bytes) and the packed code bits,
+//integers least significant byte first. A frame with zero characters ends the stream. Encoders
+//only supply the code bits of a frame, the framing and buffering are done here
+class frame_writer {
+public:
+	frame_writer(std::ostream &output);
+	virtual ~frame_writer() = default;
+
+	bool write(const char *data, std::size_t size);
+	bool encode(std::istream &input);
+	bool flush();
+	bool finish();
+	static const std::size_t frame_size = 1 << 16; //Most characters in one frame
+protected:
+	virtual bool encode_frame(const char *data, std::size_t size, packed_bits &packed) = 0;
+private:
+	std::ostream &output;
+	std::vector<char> pending; //Characters waiting for a full frame or a flush
+	packed_bits packed; //Reused for the code bits of each frame
+	std::vector<uint8_t> frame_header;
+	bool finished = false;
+	bool write_frame(const char *data, std::size_t size);
+};
+
+class frame_reader {
+public:
+	frame_reader(std::istream &input, unsigned int max_code_length);
+	virtual ~frame_reader() = default;
+
+	std::size_t read(char *buffer, std::size_t size);
+	bool decode(std::ostream &output);
+	bool at_end() const;
+	bool failed() const;
+protected:
+	virtual bool decode_frame(const packed_bits &packed, std::size_t size, std::string &decoded) = 0;
+private:
+	std::istream &input;
+	unsigned int max_code_length; //Longest code the encoder can write, bounds the code bits of a frame
+	packed_bits packed; //Reused for the code bits of each frame
+	std::string decoded; //The characters of the current frame
+	std::size_t decoded_position = 0; //Characters of decoded already returned by read
+	bool ended = false; //The end frame has been read
+	bool error = false; //The stream was damaged or ended without an end frame
+	bool read_frame();
+};
+
+class huffman_encoder : public frame_writer {
+public:
+	huffman_encoder(const huffman_tree &tree, std::ostream &output);
+private:
+	const huffman_tree &tree;
+	bool encode_frame(const char *data, std::size_t size, packed_bits &packed) override;
+};
+
+class huffman_decoder : public frame_reader {
+public:
+	huffman_decoder(const huffman_tree &tree, std::istream &input);
+private:
+	const huffman_tree &tree;
+	bool decode_frame(const packed_bits &packed, std::size_t size, std::string &decoded) override;
+};
+
+//Code tree of Vitter's adaptive Huffman coding. It starts with only the NYT (not yet transmitted) leaf,
+//whose code followed by the 8 bits of a character brings in a character not seen before. After each
+//character the tree is updated, so the encoder and the decoder change their codes in step without a model
+class adaptive_huffman_model {
+public:
+	adaptive_huffman_model();
+
+	void encode(unsigned char character, bit_writer &writer);
+	int decode(bit_reader &reader, uint64_t bit_count);
+	static const unsigned int max_code_length = 2 * 256 + 8; //Bounds the bits of one character, NYT code and character bits included
+private:
+	struct adaptive_node {
+		uint64_t weight; //Times the characters below this node have been seen
+		uint16_t parent; //none for the root
+		uint16_t children[2]; //Reached with a 0 and a 1 bit, none for leaves
+		uint16_t number; //Position in the order of the nodes by weight, the root has the highest number
+		int16_t character; //The character of a leaf, -1 for internal nodes and the NYT
+	};
+	static const uint16_t none = 0xFFFF;
+	static const unsigned int max_nodes = 2 * 257 - 1; //256 character leaves and the NYT
+	adaptive_node nodes[max_nodes];
+	uint16_t by_number[max_nodes]; //The node with each number, numbers below the NYT's aren't used yet
+	uint16_t leaves[256]; //The leaf of each character, none for characters not seen yet
+	uint16_t node_count = 0;
+	uint16_t root = 0;
+	uint16_t nyt = 0; //none once every character has been seen
+	unsigned int seen = 0; //Number of characters with a leaf
+	bool is_leaf(uint16_t node) const;
+	void update(unsigned char character);
+	uint16_t slide_and_increment(uint16_t node);
+	void swap_nodes(uint16_t first, uint16_t second);
+};
+
+//Frames have the same layout as for huffman_encoder, but the codes come from an adaptive_huffman_model
+//carried from frame to frame, so nothing has to be known about the data before the first frame
+class adaptive_huffman_encoder : public frame_writer {
+public:
+	adaptive_huffman_encoder(std::ostream &output);
+private:
+	adaptive_huffman_model model;
+	bool encode_frame(const char *data, std::size_t size, packed_bits &packed) override;
+};
+
+class adaptive_huffman_decoder : public frame_reader {
+public:
+	adaptive_huffman_decoder(std::istream &input);
+private:
+	adaptive_huffman_model model;
+	bool decode_frame(const packed_bits &packed, std::size_t size, std::string &decoded) override;
 };
 
 #endif